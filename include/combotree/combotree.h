@@ -18,6 +18,14 @@ struct Pair {
   uint64_t value;
 };
 
+// values of the keys in a range, see ComboTree::AggregateRange()
+struct RangeStats {
+  size_t count;
+  uint64_t sum;        // wraps around on overflow
+  uint64_t min_value;  // UINT64_MAX if count is 0
+  uint64_t max_value;  // 0 if count is 0
+};
+
 class ComboTree {
  public:
   ComboTree(std::string pool_dir, size_t pool_size, bool create = true);
@@ -27,12 +35,35 @@ class ComboTree {
   bool Update(uint64_t key, uint64_t value);
   bool Get(uint64_t key, uint64_t& value) const;
   bool Delete(uint64_t key);
+  // at most max_size pairs with keys in [min_key, max_key] in key order,
+  // appended to results or written to results[0, return value).
+  // uint64_t* results only gets values.
   size_t Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
       std::vector<std::pair<uint64_t, uint64_t>>& results);
   size_t Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
       Pair* results);
   size_t Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
       uint64_t* results);
+  // scan keys in [min_key, max_key] with thread_num threads. blevel entries
+  // of the range are split into chunks disjoint chunks, chunk_fn(chunk, key,
+  // value) gets the pairs of one chunk from one thread in key order, a
+  // chunk with smaller index has smaller keys. return the number of pairs.
+  size_t ParallelScan(uint64_t min_key, uint64_t max_key, int chunks, int thread_num,
+      const std::function<void(int, uint64_t, uint64_t)>& chunk_fn) const;
+  // pairs of chunk i are appended to results[i]
+  size_t ParallelScan(uint64_t min_key, uint64_t max_key, int chunks, int thread_num,
+      std::vector<std::vector<std::pair<uint64_t, uint64_t>>>& results) const;
+  // aggregation of keys in [min_key, max_key]. blevel buffers and clevel
+  // leaves are reduced in place, pairs are neither sorted nor copied
+  // (optimistic readers copy a few leaves at a time).
+  RangeStats AggregateRange(uint64_t min_key, uint64_t max_key) const;
+  size_t CountRange(uint64_t min_key, uint64_t max_key) const;
+  uint64_t SumRange(uint64_t min_key, uint64_t max_key) const;
+  // reducer(key, value) on every pair in [min_key, max_key], in no
+  // particular key order. it is called with no lock held and may call back
+  // into the tree, pairs it changes may or may not be visited.
+  void ReduceRange(uint64_t min_key, uint64_t max_key,
+      const std::function<void(uint64_t, uint64_t)>& reducer) const;
 
   size_t Size() const;
   size_t CLevelCount() const;
@@ -40,6 +71,23 @@ class ComboTree {
   void BLevelCompression() const;
   int64_t CLevelTime() const;
   uint64_t Usage() const;
+  uint64_t LockUsage() const;
+  uint64_t FilterUsage() const;
+  // pmem bytes freed by deletes, reused by later puts
+  uint64_t ReclaimableUsage() const;
+
+  // build an empty tree from pairs sorted by key without duplicates. the
+  // blevel is built directly, skipping pmemkv and expansions. must not run
+  // with other writers. return false if the tree is not empty.
+  bool BulkLoad(const std::pair<uint64_t,uint64_t>* pairs, size_t count);
+  // pairs are sorted in place by sort_threads threads first, the last
+  // value of a duplicate key is kept.
+  bool BulkLoad(std::vector<std::pair<uint64_t,uint64_t>>& pairs, int sort_threads);
+
+  // rebuild a smaller blevel and alevel for current size, like expansion.
+  // also done by Delete() when size drops below the low-water mark.
+  // return false if nothing is done, otherwise return after rebuilding.
+  bool Contract();
 
   bool IsExpanding() const {
     return permit_delete_.load() == false;
@@ -48,12 +96,14 @@ class ComboTree {
  private:
   class IterImpl;
   class NoSortIterImpl;
+  class ReverseIterImpl;
 
  public:
   class Iter {
    public:
     Iter(const ComboTree* tree);
     Iter(const ComboTree* tree, uint64_t start_key);
+    ~Iter();
 
     uint64_t key() const;
     uint64_t value() const;
@@ -68,6 +118,7 @@ class ComboTree {
    public:
     NoSortIter(const ComboTree* tree);
     NoSortIter(const ComboTree* tree, uint64_t start_key);
+    ~NoSortIter();
 
     uint64_t key() const;
     uint64_t value() const;
@@ -78,6 +129,25 @@ class ComboTree {
     NoSortIterImpl* pimpl_;
   };
 
+  // iterate in descending key order, from the largest key or from the
+  // largest key less than or equal to start_key.
+  class ReverseIter {
+   public:
+    ReverseIter(const ComboTree* tree);
+    ReverseIter(const ComboTree* tree, uint64_t start_key);
+    ~ReverseIter();
+
+    // move to the largest key less than or equal to key
+    void SeekForPrev(uint64_t key);
+    uint64_t key() const;
+    uint64_t value() const;
+    bool next();
+    bool end() const;
+
+   private:
+    ReverseIterImpl* pimpl_;
+  };
+
  private:
   const std::string POOL_LAYOUT = "Combo Tree";
 
@@ -85,7 +155,7 @@ class ComboTree {
     USING_PMEMKV,
     PMEMKV_TO_COMBO_TREE,
     USING_COMBO_TREE,
-    COMBO_TREE_EXPANDING,
+    COMBO_TREE_EXPANDING, // also used by contraction
   };
 
   std::string pool_dir_;
@@ -93,20 +163,35 @@ class ComboTree {
   // pmem::obj::pool_base pop_;
   std::shared_ptr<ALevel> alevel_;
   std::shared_ptr<BLevel> blevel_;
+  // blevel being built by online expansion
+  std::shared_ptr<BLevel> expand_blevel_;
   std::shared_ptr<PmemKV> pmemkv_;
   Manifest* manifest_;
   std::atomic<State> status_;
-  // max key finish expanding or in expanding
+  // during expansion, keys less than expand_min_key_ are in expand_blevel_,
+  // keys larger or equal to expand_max_key_ are in blevel_, others are
+  // being migrated.
   std::atomic<uint64_t> expand_min_key_;
   std::atomic<uint64_t> expand_max_key_;
   std::atomic<bool> permit_delete_;
 
   bool ValidPoolDir_();
-  void ChangeToComboTree_();
+  // pairs are scanned from pmemkv if not given
+  bool ChangeToComboTree_(const std::pair<uint64_t,uint64_t>* pairs = nullptr,
+                          size_t count = 0);
   void ExpandComboTree_();
-  size_t Scan_(uint64_t min_key, uint64_t max_key, size_t max_size,
-      size_t& count, void (*callback)(uint64_t,uint64_t,void*), void* arg,
-      std::function<uint64_t()> cur_max_key);
+  bool NeedContract_() const;
+  // out(key, value) is called on every pair of Scan()
+  template <typename Out>
+  size_t Scan_(uint64_t min_key, uint64_t max_key, size_t max_size, Out&& out) const;
+  // like Scan_(), but from max_key in descending key order
+  template <typename Out>
+  size_t ReverseScan_(uint64_t min_key, uint64_t max_key, size_t max_size, Out&& out) const;
+  // blevel_fn(blevel, min_key, max_key, begin, end) on the blevels holding
+  // [min_key, max_key], or pair_fn(key, value) on pairs of pmemkv
+  template <typename BLevelFn, typename PairFn>
+  void VisitRange_(uint64_t min_key, uint64_t max_key, BLevelFn blevel_fn,
+                   PairFn pair_fn) const;
 };
 
 } // namespace combotree
\ No newline at end of file
@@ -1,40 +1,205 @@
 #include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <thread>
+#include <vector>
 #include "combotree_config.h"
 #include "alevel.h"
 
 namespace combotree {
 
-ALevel::ALevel(std::shared_ptr<BLevel> blevel, int span)
-    : span_(span), blevel_(blevel)
+namespace {
+
+// shrinking cone: every segment passes through its first point, and the
+// slope is kept in [slope_lo, slope_hi] so that all points added to the
+// segment are predicted within epsilon.
+class SegmentBuilder {
+ public:
+  SegmentBuilder(int epsilon)
+    : epsilon_(epsilon), has_point_(false), start_x_(0), start_y_(0),
+      last_x_(0), slope_lo_(0.0), slope_hi_(0.0) {}
+
+  template<typename Segment>
+  void AddPoint(uint64_t x, uint64_t y, std::vector<Segment>& segments) {
+    if (has_point_ && x == last_x_)
+      return;
+
+    if (!has_point_ || !Fit_(x, y)) {
+      if (has_point_)
+        Close_(segments);
+      start_x_ = x;
+      start_y_ = y;
+      slope_lo_ = 0.0;
+      slope_hi_ = std::numeric_limits<double>::infinity();
+      has_point_ = true;
+    }
+    last_x_ = x;
+  }
+
+  template<typename Segment>
+  void Finish(std::vector<Segment>& segments) {
+    if (has_point_)
+      Close_(segments);
+    has_point_ = false;
+  }
+
+ private:
+  int epsilon_;
+  bool has_point_;
+  uint64_t start_x_;
+  uint64_t start_y_;
+  uint64_t last_x_;
+  double slope_lo_;
+  double slope_hi_;
+
+  bool Fit_(uint64_t x, uint64_t y) {
+    double dx = (double)(x - start_x_);
+    double dy = (double)y - (double)start_y_;
+    double lo = std::max(slope_lo_, (dy - epsilon_) / dx);
+    double hi = std::min(slope_hi_, (dy + epsilon_) / dx);
+    if (lo > hi)
+      return false;
+    slope_lo_ = lo;
+    slope_hi_ = hi;
+    return true;
+  }
+
+  template<typename Segment>
+  void Close_(std::vector<Segment>& segments) {
+    Segment seg;
+    seg.key = start_x_;
+    seg.offset = start_y_;
+    seg.slope = slope_hi_ == std::numeric_limits<double>::infinity() ?
+                slope_lo_ : (slope_lo_ + slope_hi_) / 2.0;
+    segments.push_back(seg);
+  }
+};
+
+} // anonymous namespace
+
+ALevel::ALevel(std::shared_ptr<BLevel> blevel, int epsilon, int thread_num)
+    : epsilon_(epsilon), blevel_(blevel), segment_(nullptr)
 {
+  assert(epsilon_ >= 1);
   min_key_ = blevel_->MinEntryKey();
   max_key_ = blevel_->MaxEntryKey();
   // actual blevel entry count is blevel_->nr_entry_ - 1
   // because the first entry in blevel is 0
   nr_blevel_entry_ = blevel_->Entries() - 1;
-  nr_entry_ = ((nr_blevel_entry_ + 1) / span_) + 1;
-  entry_ = new Entry[nr_entry_];
-
-  entry_[0].key = min_key_;
-  entry_[0].offset = 1;
-  for (uint64_t offset = 2; offset < blevel_->Entries(); ++offset) {
-    // calculate cdf and index for every key
-    uint64_t cur_key = blevel_->EntryKey(offset);
-    int index = CDFIndex_(cur_key);
-    if (entry_[index].key == 0) {
-      entry_[index].key = cur_key;
-      entry_[index].offset = offset;
-      for (int i = index - 1; i > 0; --i) {
-        if (entry_[i].key != 0) break;
-        entry_[i].key = cur_key;
-        entry_[i].offset = offset;
-      }
-    }
+  Build_(thread_num);
+}
+
+ALevel::ALevel(std::shared_ptr<BLevel> blevel, const std::string& file, int epsilon,
+               int thread_num)
+    : epsilon_(epsilon), blevel_(blevel), segment_(nullptr)
+{
+  assert(epsilon_ >= 1);
+  min_key_ = blevel_->MinEntryKey();
+  max_key_ = blevel_->MaxEntryKey();
+  nr_blevel_entry_ = blevel_->Entries() - 1;
+  if (!Load_(file)) {
+    LOG(Debug::WARNING, "%s does not match blevel, rebuild alevel", file.c_str());
+    Build_(thread_num);
+  }
+}
+
+ALevel::~ALevel() {
+  delete[] segment_;
+}
+
+void ALevel::Persist(const std::string& file) const {
+  size_t len = sizeof(FileHeader) + nr_segment_ * sizeof(Segment);
+  size_t mapped_len;
+  int is_pmem;
+  std::filesystem::remove(file);
+  void* addr = pmem_map_file(file.c_str(), len, PMEM_FILE_CREATE | PMEM_FILE_EXCL,
+                             0666, &mapped_len, &is_pmem);
+  if (addr == nullptr) {
+    perror("ALevel::Persist(): pmem_map_file");
+    exit(1);
+  }
+  FileHeader* header = (FileHeader*)addr;
+  header->blevel_id = blevel_->Id();
+  header->epsilon = epsilon_;
+  header->min_key = min_key_;
+  header->max_key = max_key_;
+  header->nr_blevel_entry = nr_blevel_entry_;
+  header->nr_segment = nr_segment_;
+  std::copy(segment_, segment_ + nr_segment_, (Segment*)(header + 1));
+  pmem_persist(addr, len);
+  header->magic = MAGIC;
+  pmem_persist(&header->magic, sizeof(header->magic));
+  pmem_unmap(addr, mapped_len);
+}
+
+// false if file is not saved for blevel_
+bool ALevel::Load_(const std::string& file) {
+  if (!std::filesystem::exists(file))
+    return false;
+  size_t mapped_len;
+  int is_pmem;
+  void* addr = pmem_map_file(file.c_str(), 0, 0, 0, &mapped_len, &is_pmem);
+  if (addr == nullptr)
+    return false;
+  const FileHeader* header = (const FileHeader*)addr;
+  bool match = mapped_len >= sizeof(FileHeader) &&
+               header->magic == MAGIC &&
+               header->blevel_id == (uint64_t)blevel_->Id() &&
+               header->epsilon == (uint64_t)epsilon_ &&
+               header->min_key == min_key_ &&
+               header->max_key == max_key_ &&
+               header->nr_blevel_entry == nr_blevel_entry_ &&
+               mapped_len >= sizeof(FileHeader) + header->nr_segment * sizeof(Segment);
+  if (match) {
+    nr_segment_ = header->nr_segment;
+    segment_ = new Segment[nr_segment_];
+    const Segment* saved = (const Segment*)(header + 1);
+    std::copy(saved, saved + nr_segment_, segment_);
   }
-  entry_[nr_entry_ - 1].key = max_key_;
-  entry_[nr_entry_ - 1].offset = nr_blevel_entry_;
-  // for (int i = 0; i < nr_entry_; ++i)
-  //   std::cout << entry_[i].key << std::endl;
+  pmem_unmap(addr, mapped_len);
+  return match;
+}
+
+void ALevel::Build_(int thread_num) {
+  // entry i owns keys [EntryKey(i), EntryKey(i+1)), so both ends of the
+  // interval are fitted to position i. any key between them is then
+  // predicted within epsilon as well, since the model is monotonic.
+  // parts are fitted independently, a segment always ends at a part end.
+  thread_num = std::max(1, std::min<int>(thread_num, nr_blevel_entry_ / 1024 + 1));
+  std::vector<std::vector<Segment>> parts(thread_num);
+  auto fit = [&](int t) {
+    uint64_t begin = nr_blevel_entry_ * t / thread_num;
+    uint64_t end = nr_blevel_entry_ * (t + 1) / thread_num;
+    SegmentBuilder builder(epsilon_);
+    uint64_t cur_key = blevel_->EntryKey(begin);
+    for (uint64_t offset = begin; offset < end; ++offset) {
+      uint64_t next_key = blevel_->EntryKey(offset + 1);
+      builder.AddPoint(cur_key, offset, parts[t]);
+      builder.AddPoint(next_key - 1, offset, parts[t]);
+      cur_key = next_key;
+    }
+    if (t == thread_num - 1)
+      builder.AddPoint(cur_key, nr_blevel_entry_, parts[t]);
+    builder.Finish(parts[t]);
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < thread_num; ++t)
+    threads.emplace_back(fit, t);
+  fit(0);
+  for (auto& t : threads)
+    t.join();
+
+  std::vector<Segment> segments;
+  for (auto& part : parts)
+    segments.insert(segments.end(), part.begin(), part.end());
+
+  nr_segment_ = segments.size();
+  segment_ = new Segment[nr_segment_];
+  std::copy(segments.begin(), segments.end(), segment_);
+
+  LOG(Debug::INFO, "alevel: %ld blevel entries, %ld segments, epsilon %d",
+      nr_blevel_entry_ + 1, nr_segment_, epsilon_);
 }
 
 void ALevel::GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const {
@@ -44,24 +209,25 @@ void ALevel::GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const
     return;
   }
   if (key >= max_key_) {
-    begin = entry_[nr_entry_ - 1].offset;
-    end = entry_[nr_entry_ - 1].offset;
+    begin = nr_blevel_entry_;
+    end = nr_blevel_entry_;
     return;
   }
 
-  uint64_t cdf_index = CDFIndex_(key);
-  if (key >= entry_[cdf_index].key) {
-    begin = entry_[cdf_index].offset;
-    if (cdf_index == nr_entry_ - 1)
-      end = begin;
-    else
-      end = entry_[cdf_index + 1].offset;
-  } else {
-    begin = entry_[cdf_index - 1].offset;
-    end = entry_[cdf_index].offset;
-    // assert(begin != end);
-    if (begin == end) begin--;
-  }
+  uint64_t seg_idx = FindSegment_(key);
+  const Segment& seg = segment_[seg_idx];
+  double pred = (double)seg.offset + seg.slope * (double)(key - seg.key);
+  // keys between the last point of this segment and the first point of
+  // next segment are extrapolated, they belong to next segment's offset.
+  double limit = seg_idx == nr_segment_ - 1 ? (double)nr_blevel_entry_ :
+                 (double)(segment_[seg_idx + 1].offset + epsilon_);
+  if (pred > limit)
+    pred = limit;
+
+  uint64_t pos = (uint64_t)(pred + 0.5);
+  begin = pos > (uint64_t)epsilon_ ? pos - epsilon_ : 0;
+  end = std::min(pos + epsilon_, nr_blevel_entry_);
+  assert(begin <= end && end - begin <= 2 * (uint64_t)epsilon_);
 }
 
-} // namespace combotree
\ No newline at end of file
+} // namespace combotree
@@ -10,14 +10,26 @@ namespace combotree {
 class ComboTree;
 
 // in-memory
+// piecewise linear model (PGM-style) of blevel entry keys. for every key,
+// the predicted blevel range [begin, end] contains the target entry and
+// end - begin <= 2 * epsilon.
 class ALevel {
  public:
-  ALevel(std::shared_ptr<BLevel> blevel, int span = DEFAULT_SPAN);
-
-  bool Put(uint64_t key, uint64_t value) {
+  // thread_num threads fit parts of blevel, used for a fast restart
+  ALevel(std::shared_ptr<BLevel> blevel, int epsilon = ALEVEL_EPSILON, int thread_num = 1);
+  // load the model saved by Persist() for the same blevel from file, or
+  // rebuild it if there is none
+  ALevel(std::shared_ptr<BLevel> blevel, const std::string& file, int epsilon,
+         int thread_num);
+  ~ALevel();
+
+  // save model to file, it is loaded only with the blevel it is built on
+  void Persist(const std::string& file) const;
+
+  bool Put(uint64_t key, uint64_t value, bool& migrated) {
     uint64_t begin, end;
     GetBLevelRange_(key, begin, end);
-    return blevel_->Put(key, value, begin, end);
+    return blevel_->Put(key, value, begin, end, migrated);
   }
 
   bool Get(uint64_t key, uint64_t& value) const {
@@ -26,45 +38,71 @@ class ALevel {
     return blevel_->Get(key, value, begin, end);
   }
 
-  bool Delete(uint64_t key, uint64_t* value) {
+  bool Delete(uint64_t key, uint64_t* value, bool& migrated) {
     uint64_t begin, end;
     GetBLevelRange_(key, begin, end);
-    return blevel_->Delete(key, value, begin, end);
+    return blevel_->Delete(key, value, begin, end, migrated);
   }
 
   size_t Size() const {
     return blevel_->Size();
   }
 
+  size_t Segments() const {
+    return nr_segment_;
+  }
+
   friend ComboTree;
 
  private:
-  struct Entry {
-    Entry() : key(0), offset(0) {}
+  // keys in [key, next segment key) are predicted by
+  // offset + slope * (key - this.key)
+  struct Segment {
+    Segment() : key(0), offset(0), slope(0.0) {}
 
     uint64_t key;
     uint64_t offset;
+    double slope;
+  };
+
+  // at the beginning of the file written by Persist(), followed by segments
+  struct FileHeader {
+    uint64_t magic;             // written last
+    uint64_t blevel_id;
+    uint64_t epsilon;
+    uint64_t min_key;
+    uint64_t max_key;
+    uint64_t nr_blevel_entry;
+    uint64_t nr_segment;
   };
 
-  int span_;
+  static const uint64_t MAGIC = 0x616c6576656c3031UL;
+
+  int epsilon_;
   std::shared_ptr<BLevel> blevel_;
   uint64_t min_key_;
   uint64_t max_key_;
   uint64_t nr_blevel_entry_;
-  uint64_t nr_entry_;
-  Entry* entry_;
-
-  double CalculateCDF_(uint64_t key) const {
-    return (double)(key - min_key_) / (double)(max_key_ - min_key_);
-  }
-
-  uint64_t CDFIndex_(uint64_t key) const {
-    if (key < min_key_) return 0;
-    if (key > max_key_) return nr_entry_ - 1;
-    return (uint64_t)((CalculateCDF_(key) * nr_blevel_entry_ + 1.0) / span_);
+  uint64_t nr_segment_;
+  Segment* segment_;
+
+  // index of the last segment whose key is less or equal to key
+  uint64_t FindSegment_(uint64_t key) const {
+    uint64_t left = 0;
+    uint64_t right = nr_segment_ - 1;
+    while (left < right) {
+      uint64_t middle = (left + right + 1) / 2;
+      if (segment_[middle].key <= key)
+        left = middle;
+      else
+        right = middle - 1;
+    }
+    return left;
   }
 
   void GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const;
+  void Build_(int thread_num);
+  bool Load_(const std::string& file);
 };
 
-} // namespace combotree
\ No newline at end of file
+} // namespace combotree
@@ -1,8 +1,10 @@
 #include <cstring>
+#include <cstdlib>
 #include <cassert>
 #include <iostream>
 #include <chrono>
 #include <shared_mutex>
+#include <thread>
 #include "combotree_config.h"
 #include "blevel.h"
 
@@ -60,7 +62,8 @@ void stream_store_entry(void* dest, void* source) {
 
 } // anonymous namespace
 
-void BLevel::ExpandData::FlushToEntry(Entry* entry, int prefix_len, CLevel::MemControl* mem) {
+void BLevel::ExpandData::FlushToEntry(Entry* entry, int prefix_len, CLevel::MemControl* mem,
+                                      BloomFilter** filter) {
   while (buf_count > entry->buf.max_entries) {
     // flush last entry.max_entries data to clevel
     // copy value
@@ -70,7 +73,7 @@ void BLevel::ExpandData::FlushToEntry(Entry* entry, int prefix_len, CLevel::MemC
     for (int i = 0; i < entry->buf.max_entries; ++i)
       memcpy(entry->buf.pkey(i), &key_buf[i+buf_count-entry->buf.max_entries], 8 - prefix_len);
     entry->buf.entries = entry->buf.max_entries;
-    entry->FlushToCLevel(mem);
+    entry->FlushToCLevel(mem, filter);
     buf_count -= entry->buf.max_entries;
   }
 #ifdef STREAMING_STORE
@@ -121,7 +124,8 @@ BLevel::Entry::Entry(uint64_t key, int prefix_len)
 }
 
 // return true if not exist before, return false if update.
-bool BLevel::Entry::Put(CLevel::MemControl* mem, uint64_t key, uint64_t value) {
+bool BLevel::Entry::Put(CLevel::MemControl* mem, uint64_t key, uint64_t value,
+                        BloomFilter** filter) {
   bool exist;
   int pos = buf.Find(key, exist);
   // already in, update
@@ -130,31 +134,40 @@ bool BLevel::Entry::Put(CLevel::MemControl* mem, uint64_t key, uint64_t value) {
     flush(buf.pvalue(pos));
     fence();
     return false;
+#ifdef BLOOM_FILTER
+  } else if (MayInCLevel(key, filter ? *filter : nullptr) &&
+             clevel.Update(mem, key, value)) {
+    // the filter rules out clevel for most new keys, so an update of a
+    // key in clevel is done there instead of adding a duplicate to buf
+    return false;
+#endif
   } else {
 #ifdef BUF_SORT
     if (buf.Full()) {
 #else
     if ((!clevel.HasSetup() && buf.entries == buf.max_entries - 1) || buf.Full()) {
 #endif
-      FlushToCLevel(mem);
+      FlushToCLevel(mem, filter);
       pos = 0;
     }
     return buf.Put(pos, key, value);
   }
 };
 
-bool BLevel::Entry::Get(CLevel::MemControl* mem, uint64_t key, uint64_t& value) const {
+bool BLevel::Entry::Get(CLevel::MemControl* mem, uint64_t key, uint64_t& value,
+                        const BloomFilter* filter) const {
   bool exist;
   int pos = buf.Find(key, exist);
   if (exist) {
     value = buf.value(pos);
     return true;
   } else {
-    return clevel.HasSetup() ? clevel.Get(mem, key, value) : false;
+    return MayInCLevel(key, filter) ? clevel.Get(mem, key, value) : false;
   }
 }
 
-bool BLevel::Entry::Delete(CLevel::MemControl* mem, uint64_t key, uint64_t* value) {
+bool BLevel::Entry::Delete(CLevel::MemControl* mem, uint64_t key, uint64_t* value,
+                           const BloomFilter* filter) {
   bool exist;
   int pos = buf.Find(key, exist);
   if (exist) {
@@ -162,122 +175,342 @@ bool BLevel::Entry::Delete(CLevel::MemControl* mem, uint64_t key, uint64_t* valu
       *value = buf.value(pos);
     return buf.Delete(pos);
   } else {
-    return clevel.HasSetup() ? clevel.Delete(mem, key, value) : false;
+    return MayInCLevel(key, filter) ? clevel.Delete(mem, key, value) : false;
   }
 }
 
-void BLevel::Entry::FlushToCLevel(CLevel::MemControl* mem) {
-  // TODO: let anothor thread do this? e.g. a little thread pool
-  Timer timer;
-  timer.Start();
-
+void BLevel::Entry::FlushToCLevel(CLevel::MemControl* mem, BloomFilter** filter) {
   if (!clevel.HasSetup()) {
+    Timer timer;
+    timer.Start();
+    AddToFilter(buf, filter);
     clevel.Setup(mem, buf);
+    clevel_time.fetch_add(timer.End());
   } else {
-    for (int i = 0; i < buf.entries; ++i)
-      assert(clevel.Put(mem, buf.key(i, entry_key), buf.value(i)) == true);
+    MergeToCLevel(mem, buf, filter);
   }
   buf.Clear();
+}
+
+void BLevel::Entry::MergeToCLevel(CLevel::MemControl* mem, const KVBuffer<48+64,8>& from,
+                                  BloomFilter** filter) {
+  Timer timer;
+  timer.Start();
+
+  AddToFilter(from, filter);
+  // one traversal for the whole buffer
+  uint64_t keys[CLevel::MAX_BATCH];
+  uint64_t values[CLevel::MAX_BATCH];
+#ifdef BUF_SORT
+  for (int i = 0; i < from.entries; ++i) {
+    keys[i] = from.key(i, entry_key);
+    values[i] = from.value(i);
+  }
+#else
+  int sorted_index[16];
+  from.GetSortedIndex(sorted_index);
+  for (int i = 0; i < from.entries; ++i) {
+    keys[i] = from.key(sorted_index[i], entry_key);
+    values[i] = from.value(sorted_index[i]);
+  }
+#endif
+  // keys updated in buf may already be in clevel, they are not new there
+  clevel.PutBatch(mem, keys, values, from.entries);
 
   clevel_time.fetch_add(timer.End());
 }
 
+// filter must be ready before clevel, see MayInCLevel()
+void BLevel::Entry::AddToFilter(const KVBuffer<48+64,8>& from, BloomFilter** filter) const {
+  if (filter == nullptr)
+    return;
+  if (*filter == nullptr)
+    *filter = new BloomFilter;
+  for (int i = 0; i < from.entries; ++i)
+    (*filter)->Add(from.key(i, entry_key));
+}
+
 
 /****************************** BLevel ******************************/
 BLevel::BLevel(size_t data_size)
-  : nr_entries_(0), size_(0),
-    clevel_mem_(CLEVEL_PMEM_FILE, CLEVEL_PMEM_FILE_SIZE)
+  : id_(file_id_++), keep_files_(false),
+    nr_entries_(0), entry_keys_(nullptr), size_(0),
+    migrated_entries_(0), migrated_size_(0),
+    clevel_mem_(CLEVEL_PMEM_FILE + std::to_string(id_), CLEVEL_PMEM_MAX_SIZE,
+                CLEVEL_SEGMENT_SIZE)
 #ifndef NO_LOCK
     , lock_(nullptr)
 #endif
+#ifdef BLOOM_FILTER
+    , filter_(nullptr)
+#endif
+#ifndef BUF_SORT
+    , sort_cache_(nullptr)
+#endif
+#ifdef ASYNC_FLUSH
+    , sealed_addr_(nullptr), sealed_len_(0), sealed_(nullptr), sealed_pool_(nullptr),
+      flush_pool_(nullptr)
+#endif
 {
-  pmem_file_ = std::string(BLEVEL_PMEM_FILE) + std::to_string(file_id_);
+  pmem_file_ = std::string(BLEVEL_PMEM_FILE) + std::to_string(id_);
   int is_pmem;
   std::filesystem::remove(pmem_file_);
   size_t file_size = sizeof(Entry)*((data_size+1+BLEVEL_EXPAND_BUF_KEY-1)/BLEVEL_EXPAND_BUF_KEY);
-  pmem_addr_ = pmem_map_file(pmem_file_.c_str(), file_size + 64,
+  // header and alignment
+  pmem_addr_ = pmem_map_file(pmem_file_.c_str(), file_size + 128,
                PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len_, &is_pmem);
   assert(is_pmem == 1);
   if (pmem_addr_ == nullptr) {
     perror("BLevel::BLevel(): pmem_map_file");
     exit(1);
   }
+  MapEntries_();
+  InitVolatile_();
+#ifdef ASYNC_FLUSH
+  MapSealed_(true);
+#endif
+}
+
+BLevel::BLevel(int id, int thread_num)
+  : id_(id), keep_files_(false),
+    nr_entries_(0), entry_keys_(nullptr), size_(0),
+    migrated_entries_(0), migrated_size_(0),
+    clevel_mem_(CLEVEL_PMEM_FILE + std::to_string(id_), CLEVEL_PMEM_MAX_SIZE,
+                CLEVEL_SEGMENT_SIZE, false, thread_num)
+#ifndef NO_LOCK
+    , lock_(nullptr)
+#endif
+#ifdef BLOOM_FILTER
+    , filter_(nullptr)
+#endif
+#ifndef BUF_SORT
+    , sort_cache_(nullptr)
+#endif
+#ifdef ASYNC_FLUSH
+    , sealed_addr_(nullptr), sealed_len_(0), sealed_(nullptr), sealed_pool_(nullptr),
+      flush_pool_(nullptr)
+#endif
+{
+  // blevels created later must not reuse the files
+  file_id_ = std::max(file_id_, id + 1);
+  pmem_file_ = std::string(BLEVEL_PMEM_FILE) + std::to_string(id_);
+  int is_pmem;
+  pmem_addr_ = pmem_map_file(pmem_file_.c_str(), 0, 0, 0, &mapped_len_, &is_pmem);
+  if (pmem_addr_ == nullptr) {
+    perror("BLevel::BLevel(): pmem_map_file");
+    exit(1);
+  }
+  MapEntries_();
+  if (header_->magic != MAGIC) {
+    fprintf(stderr, "BLevel::BLevel(): %s is not a finished blevel\n", pmem_file_.c_str());
+    exit(1);
+  }
+  nr_entries_ = header_->nr_entries;
+  InitVolatile_();
+#ifdef ASYNC_FLUSH
+  MapSealed_(false);
+#endif
 
-  // aligned at 64-bytes
-  entries_ = (Entry*)pmem_addr_;
-  if (((uintptr_t)entries_ & (uintptr_t)63) != 0) {
-    // not aligned
-    entries_ = (Entry*)(((uintptr_t)entries_+64) & ~(uintptr_t)63);
+  // clevel nodes are recovered by clevel_mem_, the rest is done here
+  std::vector<std::thread> threads;
+  std::vector<size_t> sizes(thread_num, 0);
+  for (int t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      uint64_t begin = nr_entries_ * t / thread_num;
+      uint64_t end = nr_entries_ * (t + 1) / thread_num;
+      for (uint64_t i = begin; i < end; ++i) {
+        Entry& entry = entries_[i];
+        entry.buf.Recover();
+        entry_keys_[i] = entry.entry_key;
+        sizes[t] += entry.buf.entries;
+        if (!entry.clevel.HasSetup())
+          continue;
+        BloomFilter** filter = FilterSlot_(i);
+        if (filter)
+          *filter = new BloomFilter;
+        for (CLevel::NoSortIter iter(&entry.clevel, &clevel_mem_, entry.entry_key);
+             !iter.end(); iter.next()) {
+          if (filter)
+            (*filter)->Add(iter.key());
+          sizes[t]++;
+        }
+      }
+    });
   }
+  for (auto& t : threads)
+    t.join();
+  for (size_t s : sizes)
+    size_ += s;
+}
 
+// entries_ follows header_, aligned at 64-bytes
+void BLevel::MapEntries_() {
+  header_ = (Header*)pmem_addr_;
+  entries_ = (Entry*)(((uintptr_t)pmem_addr_ + sizeof(Header) + 63) & ~(uintptr_t)63);
   entries_offset_ = (uint64_t)entries_ - (uint64_t)pmem_addr_;
+  max_entries_ = (mapped_len_ - entries_offset_) / sizeof(Entry);
+}
+
+void BLevel::InitVolatile_() {
+  size_t keys_size = (sizeof(uint64_t)*max_entries_ + 63) & ~(size_t)63;
+  entry_keys_ = (uint64_t*)aligned_alloc(64, keys_size);
+  if (entry_keys_ == nullptr) {
+    perror("BLevel::BLevel(): aligned_alloc");
+    exit(1);
+  }
+
+#ifndef NO_LOCK
+  // allocated up front because entries are created while the blevel is
+  // already serving requests during online expansion.
+  // plus one because of scan
+  lock_ = new EntryLock[max_entries_+1];
+#endif
+#ifdef BLOOM_FILTER
+  filter_ = new BloomFilter*[max_entries_+1]();
+#endif
+#ifndef BUF_SORT
+  sort_cache_ = new std::atomic<uint64_t>[max_entries_+1]();
+#endif
+#ifdef ASYNC_FLUSH
+  sealed_ = new SealedBuf*[max_entries_+1]();
+  flush_pool_ = new ThreadPool(CLEVEL_FLUSH_THREADS);
+#endif
+}
+
+// a blevel can be reopened after its header is persisted
+void BLevel::PersistHeader_() {
+  header_->nr_entries = nr_entries_;
+  header_->magic = MAGIC;
+  flush(header_);
+  fence();
+}
+
+void BLevel::KeepFiles() {
+  keep_files_ = true;
+  clevel_mem_.KeepFiles();
 }
 
 BLevel::~BLevel() {
+#ifdef ASYNC_FLUSH
+  // wait for pending merges
+  if (flush_pool_) delete flush_pool_;
+  if (sealed_) delete[] sealed_;
+  if (sealed_addr_ != nullptr) {
+    pmem_unmap(sealed_addr_, sealed_len_);
+    if (!keep_files_)
+      std::filesystem::remove(pmem_file_ + "-sealed");
+  }
+#endif
   if (pmem_addr_ != nullptr) {
     pmem_unmap(pmem_addr_, mapped_len_);
-    std::filesystem::remove(pmem_file_);
+    if (!keep_files_)
+      std::filesystem::remove(pmem_file_);
   }
+  free(entry_keys_);
 #ifndef NO_LOCK
-  if (lock_) delete lock_;
+  if (lock_) delete[] lock_;
+#endif
+#ifdef BLOOM_FILTER
+  if (filter_) {
+    for (uint64_t i = 0; i <= max_entries_; ++i)
+      delete filter_[i];
+    delete[] filter_;
+  }
+#endif
+#ifndef BUF_SORT
+  if (sort_cache_) delete[] sort_cache_;
 #endif
 }
 
 void BLevel::ExpandPut_(ExpandData& data, uint64_t key, uint64_t value) {
+  if (data.overflow) {
+    // no room for new entry, the last entry takes all the remaining keys
+#ifndef NO_LOCK
+    std::lock_guard<EntryLock> lock(lock_[nr_entries_-1]);
+#endif
+    if (entries_[nr_entries_-1].Put(&clevel_mem_, key, value, FilterSlot_(nr_entries_-1)))
+      data.size++;
+    return;
+  }
   if (data.buf_count == BLEVEL_EXPAND_BUF_KEY) {
     // buf full, add a new entry
-    if (data.zero_entry && data.key_buf[0] != 0) {
-      int prefix_len = CommonPrefixBytes(0UL, key);
-      Entry* new_entry = new (data.new_addr) Entry(0UL, prefix_len);
-      data.FlushToEntry(new_entry, prefix_len, &clevel_mem_);
-    } else {
-      int prefix_len = CommonPrefixBytes(data.key_buf[0], key);
-      Entry* new_entry = new (data.new_addr) Entry(data.key_buf[0], prefix_len);
-      data.FlushToEntry(new_entry, prefix_len, &clevel_mem_);
-    }
+    uint64_t index = data.new_addr - entries_;
+    assert(index < max_entries_);
+    uint64_t entry_key = data.zero_entry && data.key_buf[0] != 0 ? 0UL : data.key_buf[0];
+    // the last entry must be able to hold any key
+    data.overflow = !data.parallel && index == max_entries_ - 1;
+    int prefix_len = CommonPrefixBytes(entry_key, data.overflow ? 0xFFFFFFFFFFFFFFFFUL : key);
+    Entry* new_entry = new (data.new_addr) Entry(entry_key, prefix_len);
+    data.FlushToEntry(new_entry, prefix_len, &clevel_mem_, FilterSlot_(index));
+    entry_keys_[index] = entry_key;
     data.new_addr++;
     data.zero_entry = false;
-    nr_entries_++;
+    if (!data.parallel) {
+      // publish new entry before moving forward min key, so that
+      // keys less than min key can always find their entry.
+      nr_entries_++;
+      if (data.min_key)
+        data.min_key->store(key);
+    }
+    if (data.overflow) {
+      LOG(Debug::WARNING, "blevel is full, put remaining keys into the last entry");
+      ExpandPut_(data, key, value);
+      return;
+    }
   }
   data.key_buf[data.buf_count] = key;
   data.value_buf[BLEVEL_EXPAND_BUF_KEY - data.buf_count - 1] = value;
   data.buf_count++;
-  size_++;
+  data.size++;
 }
 
 void BLevel::ExpandFinish_(ExpandData& data) {
-  assert(data.zero_entry != true);
-  if (data.buf_count != 0) {
-    int prefix_len = CommonPrefixBytes(data.key_buf[0], 0xFFFFFFFFFFFFFFFFUL);
-    Entry* new_entry = new (data.new_addr) Entry(data.key_buf[0], prefix_len);
-    data.FlushToEntry(new_entry, prefix_len, &clevel_mem_);
+  // the first entry is still not built if there are only a few pairs, or
+  // none at all when contracting an empty tree. it holds keys from 0.
+  if (data.buf_count != 0 || data.zero_entry) {
+    assert(!data.zero_entry || data.new_addr == entries_);
+    uint64_t index = data.new_addr - entries_;
+    assert(index < max_entries_);
+    uint64_t entry_key = data.zero_entry ? 0UL : data.key_buf[0];
+    int prefix_len = CommonPrefixBytes(entry_key, 0xFFFFFFFFFFFFFFFFUL);
+    Entry* new_entry = new (data.new_addr) Entry(entry_key, prefix_len);
+    data.FlushToEntry(new_entry, prefix_len, &clevel_mem_, FilterSlot_(index));
+    entry_keys_[index] = entry_key;
     data.new_addr++;
-    nr_entries_++;
+    data.zero_entry = false;
+    if (!data.parallel)
+      nr_entries_++;
   }
+  if (data.min_key)
+    data.min_key->store(UINT64_MAX);
 }
 
-void BLevel::Expansion(std::vector<std::pair<uint64_t,uint64_t>>& data) {
+void BLevel::Expansion(const std::pair<uint64_t,uint64_t>* data, size_t count) {
   size_ = 0;
 
-  if (data.empty())
+  if (count == 0)
     return;
 
   ExpandData expand_meta(entries_);
-  for (size_t i = 0; i < data.size(); ++i)
+  for (size_t i = 0; i < count; ++i) {
+    assert(i == 0 || data[i-1].first < data[i].first);
     ExpandPut_(expand_meta, data[i].first, data[i].second);
+  }
   ExpandFinish_(expand_meta);
-
-#ifndef NO_LOCK
-  // plus one because of scan
-  lock_ = new std::shared_mutex[Entries()+1];
-#endif
+  size_ = expand_meta.size;
+  PersistHeader_();
 }
 
-void BLevel::Expansion(BLevel* old_blevel) {
+// entries of old_blevel are migrated one by one. keys in
+// [min_key, max_key) are being migrated, keys less than min_key are already
+// in this blevel and keys larger or equal to max_key are still in old_blevel.
+void BLevel::Expansion(BLevel* old_blevel, std::atomic<uint64_t>* min_key,
+                       std::atomic<uint64_t>* max_key) {
   uint64_t old_index = 0;
-  ExpandData expand_meta(entries_);
+  ExpandData expand_meta(entries_, min_key);
   Entry* old_entry;
   CLevel::MemControl* old_mem = &old_blevel->clevel_mem_;
+  uint64_t old_entries = old_blevel->Entries();
 
   size_ = 0;
 
@@ -286,50 +519,308 @@ void BLevel::Expansion(BLevel* old_blevel) {
   old_entry = &in_mem_entry;
 #endif
 
-  while (old_index < old_blevel->Entries()) {
+  while (old_index < old_entries) {
+    {
 #ifndef NO_LOCK
-    // lock before streaming load
-    std::lock_guard<std::shared_mutex> lock(old_blevel->lock_[old_index]);
+      // lock before streaming load
+      std::lock_guard<EntryLock> lock(old_blevel->lock_[old_index]);
+#endif
+#ifdef ASYNC_FLUSH
+      if (old_blevel->sealed_[old_index])
+        old_blevel->MergeSealed_(old_index);
 #endif
 #ifdef STREAMING_LOAD
-    stream_load_entry(&in_mem_entry, &old_blevel->entries_[old_index]);
+      stream_load_entry(&in_mem_entry, &old_blevel->entries_[old_index]);
 #else
-    old_entry = &old_blevel->entries_[old_index];
+      old_entry = &old_blevel->entries_[old_index];
 #endif
 
-    if (old_entry->clevel.HasSetup()) {
-      expand_meta.clevel_count++;
-      Entry::Iter biter(old_entry, old_mem);
       uint64_t total_cnt = 0;
-      do {
-        total_cnt++;
-        ExpandPut_(expand_meta, biter.key(), biter.value());
-      } while(biter.next());
-      expand_meta.clevel_data_count += total_cnt - old_entry->buf.entries;
-    } else if (!old_entry->buf.Empty()) {
+      if (old_entry->clevel.HasSetup()) {
+        expand_meta.clevel_count++;
+        Entry::Iter biter(old_entry, old_mem);
+        // clevel may be empty after deletes
+        for (; !biter.end(); biter.next()) {
+          total_cnt++;
+          ExpandPut_(expand_meta, biter.key(), biter.value());
+        }
+        expand_meta.clevel_data_count += total_cnt - old_entry->buf.entries;
+      } else if (!old_entry->buf.Empty()) {
 #ifdef BUF_SORT
-      for (uint64_t i = 0; i < old_entry->buf.entries; ++i)
-        ExpandPut_(expand_meta, old_entry->key(i), old_entry->value(i));
+        for (uint64_t i = 0; i < old_entry->buf.entries; ++i)
+          ExpandPut_(expand_meta, old_entry->key(i), old_entry->value(i));
 #else
-      int sorted_index[16];
-      old_entry->buf.GetSortedIndex(sorted_index);
-      for (uint64_t i = 0; i < old_entry->buf.entries; ++i)
-        ExpandPut_(expand_meta, old_entry->key(sorted_index[i]), old_entry->value(sorted_index[i]));
+        int sorted_index[16];
+        old_entry->buf.GetSortedIndex(sorted_index);
+        for (uint64_t i = 0; i < old_entry->buf.entries; ++i)
+          ExpandPut_(expand_meta, old_entry->key(sorted_index[i]), old_entry->value(sorted_index[i]));
 #endif
+        total_cnt = old_entry->buf.entries;
+      }
+
+      // writers holding this lock after us will see the entry is migrated
+      size_ += expand_meta.size;
+      expand_meta.size = 0;
+      old_blevel->migrated_size_ += total_cnt;
+      old_blevel->migrated_entries_.store(old_index + 1);
     }
     old_index++;
+    if (max_key)
+      max_key->store(old_index < old_entries ? old_blevel->EntryKey(old_index) : UINT64_MAX);
   }
 
   ExpandFinish_(expand_meta);
+  size_ += expand_meta.size;
+  PersistHeader_();
 
   LOG(Debug::INFO, "data in clevel: %ld, clevel count: %ld, pairs per clevel: %lf",
       expand_meta.clevel_data_count, expand_meta.clevel_count, (double)expand_meta.clevel_data_count/(double)expand_meta.clevel_count);
+}
 
+// put pairs of old_blevel into data, starting from entry old_index and
+// skipping the first skip pairs. stop when the entry before end_addr is
+// built, or finish the last entry if there is no more pairs.
+void BLevel::ExpandRange_(ExpandData& data, BLevel* old_blevel, uint64_t old_index,
+                          uint64_t skip, Entry* end_addr) {
+  CLevel::MemControl* old_mem = &old_blevel->clevel_mem_;
+  for (; old_index < old_blevel->Entries(); ++old_index) {
+    Entry* old_entry = &old_blevel->entries_[old_index];
+    if (old_entry->clevel.HasSetup()) {
+      data.clevel_count++;
+      Entry::Iter biter(old_entry, old_mem);
+      uint64_t total_cnt = 0;
+      for (; !biter.end(); biter.next()) {
+        total_cnt++;
+        if (skip) {
+          skip--;
+          continue;
+        }
+        ExpandPut_(data, biter.key(), biter.value());
+        if (data.new_addr == end_addr)
+          return;
+      }
+      data.clevel_data_count += total_cnt - old_entry->buf.entries;
+    } else if (!old_entry->buf.Empty()) {
+      int sorted_index[16];
+#ifdef BUF_SORT
+      for (int i = 0; i < old_entry->buf.entries; ++i)
+        sorted_index[i] = i;
+#else
+      old_entry->buf.GetSortedIndex(sorted_index);
+#endif
+      for (uint64_t i = 0; i < old_entry->buf.entries; ++i) {
+        if (skip) {
+          skip--;
+          continue;
+        }
+        ExpandPut_(data, old_entry->key(sorted_index[i]), old_entry->value(sorted_index[i]));
+        if (data.new_addr == end_addr)
+          return;
+      }
+    }
+  }
+  ExpandFinish_(data);
+}
+
+// old entries are split into thread_num partitions. new entry i holds the
+// pairs [i*BLEVEL_EXPAND_BUF_KEY, (i+1)*BLEVEL_EXPAND_BUF_KEY) in key order,
+// so once the pair count of every partition is known, each worker knows
+// which new entries it builds and where its first pair is.
+void BLevel::ParallelExpansion(BLevel* old_blevel, int thread_num,
+                               std::atomic<uint64_t>* min_key,
+                               std::atomic<uint64_t>* max_key) {
+  uint64_t old_entries = old_blevel->Entries();
+  if (thread_num <= 1 || old_entries < (uint64_t)thread_num) {
+    Expansion(old_blevel, min_key, max_key);
+    return;
+  }
+
+  // writers must not change old_blevel while it is counted. mark all entries
+  // as migrated, then wait for writers already holding the lock.
+  if (max_key)
+    max_key->store(UINT64_MAX);
+  old_blevel->migrated_entries_.store(old_entries);
 #ifndef NO_LOCK
-  // plus one because of scan
-  lock_ = new std::shared_mutex[Entries()+1];
+  for (uint64_t i = 0; i < old_entries; ++i) {
+    old_blevel->lock_[i].lock();
+#ifdef ASYNC_FLUSH
+    if (old_blevel->sealed_[i])
+      old_blevel->MergeSealed_(i);
+#endif
+    old_blevel->lock_[i].unlock();
+  }
+#endif
+
+  std::vector<uint64_t> part_begin(thread_num + 1);
+  std::vector<uint64_t> part_size(thread_num + 1, 0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i <= thread_num; ++i)
+    part_begin[i] = old_entries * i / thread_num;
+
+  // count pairs in every partition
+  for (int t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      uint64_t cnt = 0;
+      for (uint64_t i = part_begin[t]; i < part_begin[t+1]; ++i) {
+        Entry* old_entry = &old_blevel->entries_[i];
+        if (old_entry->clevel.HasSetup()) {
+          Entry::Iter biter(old_entry, &old_blevel->clevel_mem_);
+          for (; !biter.end(); biter.next())
+            cnt++;
+        } else {
+          cnt += old_entry->buf.entries;
+        }
+      }
+      part_size[t] = cnt;
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+
+  // prefix count, part_size[t] becomes the index of first pair of partition t
+  uint64_t total = 0;
+  for (int t = 0; t <= thread_num; ++t) {
+    uint64_t cnt = part_size[t];
+    part_size[t] = total;
+    total += cnt;
+  }
+  uint64_t total_entries = (total + BLEVEL_EXPAND_BUF_KEY - 1) / BLEVEL_EXPAND_BUF_KEY;
+  if (total_entries > max_entries_ || total == 0) {
+    LOG(Debug::WARNING, "blevel is too small or empty for parallel expansion, fall back to serial");
+    old_blevel->migrated_entries_.store(0);
+    if (max_key)
+      max_key->store(0);
+    Expansion(old_blevel, min_key, max_key);
+    return;
+  }
+
+  std::vector<ExpandData> expand_meta(thread_num, ExpandData(entries_));
+  for (int t = 0; t < thread_num; ++t) {
+    uint64_t first_entry = (part_size[t] + BLEVEL_EXPAND_BUF_KEY - 1) / BLEVEL_EXPAND_BUF_KEY;
+    uint64_t end_entry = t == thread_num - 1 ? total_entries :
+        (part_size[t+1] + BLEVEL_EXPAND_BUF_KEY - 1) / BLEVEL_EXPAND_BUF_KEY;
+    if (first_entry == end_entry)
+      continue;
+    // pairs before the first new entry are built by previous workers
+    uint64_t skip = first_entry * BLEVEL_EXPAND_BUF_KEY - part_size[t];
+    expand_meta[t].new_addr = entries_ + first_entry;
+    expand_meta[t].zero_entry = first_entry == 0;
+    expand_meta[t].parallel = true;
+    threads.emplace_back([&, t, skip, end_entry]() {
+      ExpandRange_(expand_meta[t], old_blevel, part_begin[t], skip, entries_ + end_entry);
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  uint64_t clevel_data_count = 0;
+  uint64_t clevel_count = 0;
+  for (int t = 0; t < thread_num; ++t) {
+    clevel_data_count += expand_meta[t].clevel_data_count;
+    clevel_count += expand_meta[t].clevel_count;
+  }
+
+  size_ = total;
+  nr_entries_ = total_entries;
+  PersistHeader_();
+  old_blevel->migrated_size_ = total;
+  if (min_key)
+    min_key->store(UINT64_MAX);
+
+  LOG(Debug::INFO, "parallel expansion with %d threads, data in clevel: %ld, clevel count: %ld",
+      thread_num, clevel_data_count, clevel_count);
+}
+
+#if !defined(NO_LOCK) && !defined(OPTIMISTIC_LOCK)
+void BLevel::LockShared_(uint64_t idx) const {
+  lock_[idx].lock_shared();
+#ifdef ASYNC_FLUSH
+  // sealed pairs are not visible to entry iterators, merge them first
+  while (sealed_[idx]) {
+    lock_[idx].unlock_shared();
+    HelpMerge_(idx);
+    lock_[idx].lock_shared();
+  }
 #endif
 }
+#endif
+
+#ifdef ASYNC_FLUSH
+void BLevel::Seal_(uint64_t idx) {
+  // last sealed buffer is not merged yet
+  if (sealed_[idx])
+    MergeSealed_(idx);
+
+  SealedBuf* sealed = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(sealed_mutex_);
+    if (!free_sealed_.empty()) {
+      sealed = free_sealed_.back();
+      free_sealed_.pop_back();
+    }
+  }
+  if (sealed == nullptr) {
+    // background threads fall behind
+    entries_[idx].FlushToCLevel(&clevel_mem_, FilterSlot_(idx));
+    return;
+  }
+
+  // the sealed buffer is persisted before the entry buffer is cleared
+  memcpy((void*)&sealed->buf, &entries_[idx].buf, sizeof(sealed->buf));
+  sealed->entry = idx + 1;
+  pmem_persist(sealed, sizeof(SealedBuf));
+  sealed_[idx] = sealed;
+  entries_[idx].buf.Clear();
+  flush_pool_->Submit([this, idx]() { HelpMerge_(idx); });
+}
+
+void BLevel::MergeSealed_(uint64_t idx) const {
+  SealedBuf* sealed = sealed_[idx];
+  entries_[idx].MergeToCLevel((CLevel::MemControl*)&clevel_mem_, sealed->buf, FilterSlot_(idx));
+  sealed->entry = 0;
+  flush(&sealed->entry);
+  fence();
+  sealed_[idx] = nullptr;
+  std::lock_guard<std::mutex> lock(sealed_mutex_);
+  free_sealed_.push_back(sealed);
+}
+
+void BLevel::MapSealed_(bool create) {
+  std::string file = pmem_file_ + "-sealed";
+  int is_pmem;
+  if (create) {
+    std::filesystem::remove(file);
+    sealed_addr_ = pmem_map_file(file.c_str(), sizeof(SealedBuf) * SEALED_BUF_NUM,
+                                 PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &sealed_len_, &is_pmem);
+  } else {
+    sealed_addr_ = pmem_map_file(file.c_str(), 0, 0, 0, &sealed_len_, &is_pmem);
+  }
+  if (sealed_addr_ == nullptr) {
+    perror("BLevel::MapSealed_(): pmem_map_file");
+    exit(1);
+  }
+  sealed_pool_ = (SealedBuf*)sealed_addr_;
+  for (int i = SEALED_BUF_NUM - 1; i >= 0; --i) {
+    SealedBuf* sealed = &sealed_pool_[i];
+    if (sealed->entry) {
+      // sealed before a crash, merging it again is harmless if it was merged
+      sealed->buf.Recover();
+      entries_[sealed->entry-1].MergeToCLevel(&clevel_mem_, sealed->buf, nullptr);
+      sealed->entry = 0;
+      flush(&sealed->entry);
+      fence();
+    }
+    free_sealed_.push_back(sealed);
+  }
+}
+
+void BLevel::HelpMerge_(uint64_t idx) const {
+  std::lock_guard<EntryLock> lock(lock_[idx]);
+  if (sealed_[idx])
+    MergeSealed_(idx);
+}
+#endif // ASYNC_FLUSH
 
 uint64_t BLevel::Find_(uint64_t key, uint64_t begin, uint64_t end) const {
   assert(begin < Entries());
@@ -339,7 +830,7 @@ uint64_t BLevel::Find_(uint64_t key, uint64_t begin, uint64_t end) const {
   // binary search
   while (left <= right) {
     int middle = (left + right) / 2;
-    uint64_t mid_key = entries_[middle].entry_key;
+    uint64_t mid_key = entry_keys_[middle];
     if (mid_key == key) {
       return middle;
     } else if (mid_key < key) {
@@ -351,12 +842,38 @@ uint64_t BLevel::Find_(uint64_t key, uint64_t begin, uint64_t end) const {
   return right;
 }
 
-bool BLevel::Put(uint64_t key, uint64_t value, uint64_t begin, uint64_t end) {
+// return the number of entries whose entry key is less than end_key
+uint64_t BLevel::EndIndex_(uint64_t end_key) const {
+  uint64_t entries = Entries();
+  if (end_key == UINT64_MAX || entries == 0)
+    return entries;
+  uint64_t idx = Find_(end_key, 0, entries - 1);
+  return entry_keys_[idx] == end_key ? idx : idx + 1;
+}
+
+bool BLevel::Put(uint64_t key, uint64_t value, uint64_t begin, uint64_t end, bool& migrated) {
   uint64_t idx = Find_(key, begin, end);
 #ifndef NO_LOCK
-  std::lock_guard<std::shared_mutex> lock(lock_[idx]);
+  std::lock_guard<EntryLock> lock(lock_[idx]);
+#endif
+  migrated = idx < migrated_entries_.load();
+  if (migrated)
+    return false;
+#ifdef ASYNC_FLUSH
+  if (entries_[idx].clevel.HasSetup() && entries_[idx].buf.Full())
+    Seal_(idx);
+  if (sealed_[idx]) {
+    bool exist;
+    int pos = sealed_[idx]->buf.Find(key, exist);
+    if (exist) {
+      *(uint64_t*)sealed_[idx]->buf.pvalue(pos) = value;
+      flush(sealed_[idx]->buf.pvalue(pos));
+      fence();
+      return false;
+    }
+  }
 #endif
-  if (entries_[idx].Put(&clevel_mem_, key, value)) {
+  if (entries_[idx].Put(&clevel_mem_, key, value, FilterSlot_(idx))) {
     size_++;
     return true;
   }
@@ -365,24 +882,129 @@ bool BLevel::Put(uint64_t key, uint64_t value, uint64_t begin, uint64_t end) {
 
 bool BLevel::Get(uint64_t key, uint64_t& value, uint64_t begin, uint64_t end) const {
   uint64_t idx = Find_(key, begin, end);
+#if defined(OPTIMISTIC_LOCK)
+  while (true) {
+    uint64_t version = lock_[idx].ReadBegin();
+#ifdef ASYNC_FLUSH
+    if (sealed_[idx]) {
+      // rare, only before the sealed buffer is merged
+      std::lock_guard<EntryLock> lock(lock_[idx]);
+      return GetLocked_(idx, key, value);
+    }
+#endif
+    bool exist;
+    uint64_t tmp_value;
+    if (entries_[idx].OptimisticGet(&clevel_mem_, key, tmp_value, exist, Filter_(idx)) &&
+        lock_[idx].Validate(version)) {
+      if (exist)
+        value = tmp_value;
+      return exist;
+    }
+  }
+#else
 #ifndef NO_LOCK
-  std::shared_lock<std::shared_mutex> lock(lock_[idx]);
+  std::shared_lock<EntryLock> lock(lock_[idx]);
+#endif
+  return GetLocked_(idx, key, value);
+#endif // OPTIMISTIC_LOCK
+}
+
+bool BLevel::GetLocked_(uint64_t idx, uint64_t key, uint64_t& value) const {
+  if (entries_[idx].Get((CLevel::MemControl*)&clevel_mem_, key, value, Filter_(idx)))
+    return true;
+#ifdef ASYNC_FLUSH
+  if (sealed_[idx]) {
+    bool exist;
+    int pos = sealed_[idx]->buf.Find(key, exist);
+    if (exist)
+      value = sealed_[idx]->buf.value(pos);
+    return exist;
+  }
 #endif
-  return entries_[idx].Get((CLevel::MemControl*)&clevel_mem_, key, value);
+  return false;
+}
+
+#ifdef OPTIMISTIC_LOCK
+// copy pairs of entry idx in [start_key, next_key) without lock. a few
+// leaves are copied at a time, so that a writer on the same entry does not
+// fail a long copy.
+void BLevel::CopyEntry_(uint64_t idx, uint64_t start_key,
+                        std::vector<std::pair<uint64_t,uint64_t>>& pairs,
+                        uint64_t& next_key) const {
+  const int max_leaf = 4;
+  while (true) {
+    pairs.clear();
+    uint64_t version = lock_[idx].ReadBegin();
+#ifdef ASYNC_FLUSH
+    // sealed pairs are not copied, merge them first
+    if (sealed_[idx]) {
+      HelpMerge_(idx);
+      continue;
+    }
+#endif
+    auto check = [&]() { return lock_[idx].Validate(version); };
+    if (entries_[idx].OptimisticCopy(&clevel_mem_, start_key, max_leaf, pairs, next_key, check) &&
+        check())
+      return;
+  }
 }
+#endif // OPTIMISTIC_LOCK
 
-bool BLevel::Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end) {
+bool BLevel::Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end, bool& migrated) {
   uint64_t idx = Find_(key, begin, end);
 #ifndef NO_LOCK
-  std::lock_guard<std::shared_mutex> lock(lock_[idx]);
+  std::lock_guard<EntryLock> lock(lock_[idx]);
 #endif
-  if (entries_[idx].Delete(&clevel_mem_, key, value)) {
+  migrated = idx < migrated_entries_.load();
+  if (migrated)
+    return false;
+#ifdef ASYNC_FLUSH
+  if (sealed_[idx]) {
+    bool exist;
+    int pos = sealed_[idx]->buf.Find(key, exist);
+    if (exist) {
+      if (value)
+        *value = sealed_[idx]->buf.value(pos);
+      sealed_[idx]->buf.Delete(pos);
+      size_--;
+      return true;
+    }
+  }
+#endif
+  if (entries_[idx].Delete(&clevel_mem_, key, value, Filter_(idx))) {
     size_--;
     return true;
   }
   return false;
 }
 
+void BLevel::Aggregate(uint64_t min_key, uint64_t max_key, uint64_t begin, uint64_t end,
+                       ValueStats& stats) const {
+#ifdef OPTIMISTIC_LOCK
+  thread_local std::vector<std::pair<uint64_t,uint64_t>> pairs;
+#endif
+  uint64_t entries = Entries();
+  for (uint64_t idx = Find_(min_key, begin, end);
+       idx < entries && entry_keys_[idx] <= max_key; ++idx) {
+    PrefetchAhead_(idx);
+#ifdef OPTIMISTIC_LOCK
+    VisitCopies_(idx, min_key, max_key, pairs, [&]() {
+      for (auto& kv : pairs) {
+        stats.count++;
+        stats.sum += kv.second;
+        stats.min = std::min(stats.min, kv.second);
+        stats.max = std::max(stats.max, kv.second);
+      }
+    });
+#else
+    VisitEntry_(idx, min_key, max_key,
+        [&](const KVBuffer<48+64,8>& buf, uint64_t prefix_key, bool all_in_range) {
+          return buf.Aggregate(prefix_key, min_key, max_key, all_in_range, stats);
+        });
+#endif
+  }
+}
+
 size_t BLevel::CountCLevel() const {
   size_t cnt = 0;
   for (uint64_t i = 0; i < Entries(); ++i)
@@ -406,7 +1028,34 @@ int64_t BLevel::CLevelTime() const {
 }
 
 uint64_t BLevel::Usage() const {
-  return clevel_mem_.Usage() + Entries() * sizeof(Entry);
+  return clevel_mem_.Usage() + Entries() * sizeof(Entry) + LockUsage() + FilterUsage();
+}
+
+// dram used by lock table
+uint64_t BLevel::LockUsage() const {
+#ifndef NO_LOCK
+  return (max_entries_ + 1) * sizeof(EntryLock);
+#else
+  return 0;
+#endif
+}
+
+// pmem of freed clevel nodes, not counted in Usage()
+uint64_t BLevel::ReclaimableUsage() const {
+  return clevel_mem_.FreeUsage();
+}
+
+// dram used by bloom filters
+uint64_t BLevel::FilterUsage() const {
+#ifdef BLOOM_FILTER
+  uint64_t cnt = 0;
+  for (uint64_t i = 0; i < Entries(); ++i)
+    if (filter_[i])
+      cnt++;
+  return (max_entries_ + 1) * sizeof(BloomFilter*) + cnt * sizeof(BloomFilter);
+#else
+  return 0;
+#endif
 }
 
 }
\ No newline at end of file
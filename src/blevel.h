@@ -4,12 +4,24 @@
 #include <cstdint>
 #include <cstddef>
 #include <vector>
-#include <shared_mutex>
+#include <algorithm>
+#include <mutex>
 #include "combotree_config.h"
 #include "kvbuffer.h"
 #include "clevel.h"
+#include "lock.h"
+#include "bloom_filter.h"
+#include "thread_pool.h"
 #include "pmem.h"
 
+#if defined(OPTIMISTIC_LOCK) && defined(NO_LOCK)
+#error "OPTIMISTIC_LOCK can not be used with NO_LOCK"
+#endif
+
+#if defined(ASYNC_FLUSH) && defined(NO_LOCK)
+#error "ASYNC_FLUSH can not be used with NO_LOCK"
+#endif
+
 namespace combotree {
 
 class Test;
@@ -32,11 +44,58 @@ class BLevel {
       return buf.value(idx);
     }
 
-    bool Put(CLevel::MemControl* mem, uint64_t key, uint64_t value);
-    bool Get(CLevel::MemControl* mem, uint64_t key, uint64_t& value) const;
-    bool Delete(CLevel::MemControl* mem, uint64_t key, uint64_t* value);
+    // filter: bloom filter of the keys in clevel, nullptr if not used.
+    // *filter is allocated when clevel is set up. a key is either in buf
+    // or in clevel.
+    bool Put(CLevel::MemControl* mem, uint64_t key, uint64_t value, BloomFilter** filter);
+    bool Get(CLevel::MemControl* mem, uint64_t key, uint64_t& value,
+             const BloomFilter* filter) const;
+    bool Delete(CLevel::MemControl* mem, uint64_t key, uint64_t* value,
+                const BloomFilter* filter);
+
+    void FlushToCLevel(CLevel::MemControl* mem, BloomFilter** filter);
+    // put pairs of from into clevel, clevel must be set up
+    void MergeToCLevel(CLevel::MemControl* mem, const KVBuffer<48+64,8>& from,
+                       BloomFilter** filter);
+    void AddToFilter(const KVBuffer<48+64,8>& from, BloomFilter** filter) const;
+
+    // false if key is surely not in clevel
+    ALWAYS_INLINE bool MayInCLevel(uint64_t key, const BloomFilter* filter) const {
+      return clevel.HasSetup() && (filter == nullptr || filter->MayContain(key));
+    }
+
+#ifdef OPTIMISTIC_LOCK
+    // read without lock, see CLevel::OptimisticGet()
+    ALWAYS_INLINE bool OptimisticGet(const CLevel::MemControl* mem, uint64_t key,
+                                     uint64_t& value, bool& exist,
+                                     const BloomFilter* filter) const {
+      int pos = buf.Find(key, exist);
+      if (exist) {
+        value = buf.value(pos);
+        return true;
+      }
+      return MayInCLevel(key, filter) ? clevel.OptimisticGet(mem, key, value, exist) : true;
+    }
 
-    void FlushToCLevel(CLevel::MemControl* mem);
+    // read without lock, copy pairs in [start_key, next_key) to pairs.
+    // see CLevel::OptimisticCopy()
+    template <typename Check>
+    bool OptimisticCopy(const CLevel::MemControl* mem, uint64_t start_key, int max_leaf,
+                        std::vector<std::pair<uint64_t,uint64_t>>& pairs,
+                        uint64_t& next_key, Check check) const {
+      next_key = UINT64_MAX;
+      if (clevel.HasSetup() &&
+          !clevel.OptimisticCopy(mem, entry_key, start_key, max_leaf, pairs, next_key, check))
+        return false;
+      for (int i = 0; i < buf.entries; ++i)
+        pairs.emplace_back(key(i), value(i));
+      pairs.erase(std::remove_if(pairs.begin(), pairs.end(),
+          [=](const std::pair<uint64_t,uint64_t>& kv) {
+            return kv.first < start_key || kv.first >= next_key;
+          }), pairs.end());
+      return true;
+    }
+#endif // OPTIMISTIC_LOCK
 
     class Iter {
 #ifdef BUF_SORT
@@ -50,11 +109,14 @@ class BLevel {
      public:
       Iter() {}
 
-      Iter(const Entry* entry, const CLevel::MemControl* mem)
+      // sort_cache: cached sorted order of entry buffer, see
+      // KVBuffer::GetSortedIndex()
+      Iter(const Entry* entry, const CLevel::MemControl* mem,
+           std::atomic<uint64_t>* sort_cache = nullptr)
         : entry_(entry), buf_idx_(0)
       {
 #ifndef BUF_SORT
-        entry->buf.GetSortedIndex(sorted_index_);
+        SortBuf_(sort_cache);
 #endif
         if (entry_->clevel.HasSetup()) {
           new (&citer_) CLevel::Iter(&entry_->clevel, mem, entry_->entry_key);
@@ -66,11 +128,12 @@ class BLevel {
         }
       }
 
-      Iter(const Entry* entry, const CLevel::MemControl* mem, uint64_t start_key)
+      Iter(const Entry* entry, const CLevel::MemControl* mem, uint64_t start_key,
+           std::atomic<uint64_t>* sort_cache = nullptr)
         : entry_(entry), buf_idx_(0)
       {
 #ifndef BUF_SORT
-        entry->buf.GetSortedIndex(sorted_index_);
+        SortBuf_(sort_cache);
 #endif
         if (start_key <= entry->entry_key) {
           if (entry_->clevel.HasSetup()) {
@@ -90,10 +153,10 @@ class BLevel {
           has_clevel_ = false;
           point_to_clevel_ = false;
         }
-        do {
+        // the entry may be empty
+        for (; !end(); next())
           if (key() >= start_key)
             return;
-        } while (next());
       }
 
       ALWAYS_INLINE uint64_t key() const {
@@ -138,6 +201,13 @@ class BLevel {
       CLevel::Iter citer_;
 #ifndef BUF_SORT
       int sorted_index_[16];
+
+      ALWAYS_INLINE void SortBuf_(std::atomic<uint64_t>* sort_cache) {
+        if (sort_cache)
+          entry_->buf.GetSortedIndex(sorted_index_, *sort_cache, 0);
+        else
+          entry_->buf.GetSortedIndex(sorted_index_);
+      }
 #endif
 
 #undef entry_key
@@ -219,75 +289,300 @@ class BLevel {
 
  public:
   BLevel(size_t entries);
+  // reopen blevel id written by a previous process, dram structures are
+  // rebuilt by thread_num threads
+  BLevel(int id, int thread_num);
   ~BLevel();
 
-  bool Put(uint64_t key, uint64_t value, uint64_t begin, uint64_t end);
+  // pmem files are not removed by destructor
+  void KeepFiles();
+  ALWAYS_INLINE int Id() const { return id_; }
+
+  // migrated is set when the entry of key has been moved to a new blevel
+  // by an online expansion, the operation is not applied in that case.
+  bool Put(uint64_t key, uint64_t value, uint64_t begin, uint64_t end, bool& migrated);
   bool Get(uint64_t key, uint64_t& value, uint64_t begin, uint64_t end) const;
-  bool Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end);
+  bool Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end, bool& migrated);
+
+  // online expansion. keys less than min_key are served by this blevel,
+  // entries of old_blevel with keys less than max_key have been migrated.
+  void Expansion(BLevel* old_blevel, std::atomic<uint64_t>* min_key = nullptr,
+                 std::atomic<uint64_t>* max_key = nullptr);
+  // data is sorted by key without duplicates
+  void Expansion(const std::pair<uint64_t,uint64_t>* data, size_t count);
+  // build the new entries with multiple threads. the result is identical
+  // to Expansion(), but old_blevel stays read-only until it finishes, so
+  // writers have to wait for the whole expansion.
+  void ParallelExpansion(BLevel* old_blevel, int thread_num,
+                         std::atomic<uint64_t>* min_key = nullptr,
+                         std::atomic<uint64_t>* max_key = nullptr);
 
-  void Expansion(BLevel* old_blevel);
-  void Expansion(std::vector<std::pair<uint64_t,uint64_t>>& data);
+  // out(key, value) is called on at most max_size pairs in
+  // [min_key, max_key] in key order, from the entry of min_key in
+  // [begin, end] until an entry key is larger than max_key. return the
+  // number of pairs.
+  template <typename Out>
+  size_t Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+              uint64_t begin, uint64_t end, Out&& out) const {
+    size_t count = 0;
+    uint64_t entries = Entries();
+    for (uint64_t idx = Find_(min_key, begin, end);
+         idx < entries && count < max_size && entry_keys_[idx] <= max_key; ++idx) {
+      PrefetchAhead_(idx);
+      count += ScanEntry_(idx, min_key, max_key, max_size - count, out);
+    }
+    return count;
+  }
+
+  // values of keys in [min_key, max_key] are added to stats, from the
+  // entry of min_key in [begin, end]. entry buffers and clevel leaves are
+  // reduced in place, nothing is sorted or copied. optimistic readers
+  // reduce validated copies of a few leaves instead, see CopyEntry_().
+  void Aggregate(uint64_t min_key, uint64_t max_key, uint64_t begin, uint64_t end,
+                 ValueStats& stats) const;
+
+  // reducer(key, value) on every pair in [min_key, max_key] in no key order.
+  // pairs of an entry are copied first, no lock is held when reducer is
+  // called, so it may call back into the tree.
+  template <typename Reducer>
+  void Reduce(uint64_t min_key, uint64_t max_key, uint64_t begin, uint64_t end,
+              Reducer&& reducer) const {
+    // not thread_local, reducer may start another Reduce()
+    std::vector<std::pair<uint64_t,uint64_t>> pairs;
+    uint64_t entries = Entries();
+    for (uint64_t idx = Find_(min_key, begin, end);
+         idx < entries && entry_keys_[idx] <= max_key; ++idx) {
+      PrefetchAhead_(idx);
+#ifdef OPTIMISTIC_LOCK
+      VisitCopies_(idx, min_key, max_key, pairs, [&]() {
+        for (auto& kv : pairs)
+          reducer(kv.first, kv.second);
+      });
+#else
+      pairs.clear();
+      VisitEntry_(idx, min_key, max_key,
+          [&](const KVBuffer<48+64,8>& buf, uint64_t prefix_key, bool) {
+            return buf.ForEach(prefix_key, min_key, max_key,
+                [&](uint64_t key, uint64_t value) { pairs.emplace_back(key, value); });
+          });
+      for (auto& kv : pairs)
+        reducer(kv.first, kv.second);
+#endif
+    }
+  }
+
+  // index of the entry of key in [begin, end]
+  ALWAYS_INLINE uint64_t FindEntry(uint64_t key, uint64_t begin, uint64_t end) const {
+    return Find_(key, begin, end);
+  }
+
+  // like Scan(), but pairs are in descending key order, from the entry of
+  // max_key in [begin, end] until an entry key is less than min_key.
+  template <typename Out>
+  size_t ReverseScan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                     uint64_t begin, uint64_t end, Out&& out) const {
+    size_t count = 0;
+    for (uint64_t idx = Find_(max_key, begin, end) + 1; idx-- > 0 && count < max_size; ) {
+      PrefetchAhead_(idx, -1);
+      count += ReverseScanEntry_(idx, min_key, max_key, max_size - count, out);
+      if (entry_keys_[idx] <= min_key)
+        break;
+    }
+    return count;
+  }
 
   // statistic
   size_t CountCLevel() const;
   void PrefixCompression() const;
   int64_t CLevelTime() const;
   uint64_t Usage() const;
+  uint64_t LockUsage() const;
+  uint64_t FilterUsage() const;
+  uint64_t ReclaimableUsage() const;
 
   ALWAYS_INLINE size_t Size() const { return size_; }
+  ALWAYS_INLINE size_t MigratedSize() const { return migrated_size_; }
   ALWAYS_INLINE size_t Entries() const { return nr_entries_; }
-  ALWAYS_INLINE uint64_t EntryKey(int index) const { return entries_[index].entry_key; }
-  ALWAYS_INLINE uint64_t MinEntryKey() const { return entries_[1].entry_key; }
-  ALWAYS_INLINE uint64_t MaxEntryKey() const { return entries_[Entries()-1].entry_key; }
+  ALWAYS_INLINE uint64_t EntryKey(int index) const { return entry_keys_[index]; }
+  ALWAYS_INLINE uint64_t MinEntryKey() const { return entry_keys_[1]; }
+  ALWAYS_INLINE uint64_t MaxEntryKey() const { return entry_keys_[Entries()-1]; }
 
+  // iterate entries whose entry key is less than end_key,
+  // UINT64_MAX means all entries.
+#ifdef OPTIMISTIC_LOCK
+  // a few leaves of an entry are copied to dram at a time without lock and
+  // validated with the entry version, then the copy is iterated.
   class Iter {
    public:
-    Iter(const BLevel* blevel)
-      : blevel_(blevel), entry_idx_(0), locked_(false)
+    Iter(const BLevel* blevel, uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), entry_idx_(0), start_key_(0)
     {
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-#endif
-      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      while (iter_.end() && ++entry_idx_ < blevel_->Entries()) {
-#ifndef NO_LOCK
-        blevel_->lock_[entry_idx_-1].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-#endif
-        new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
+      end_idx_ = blevel_->EndIndex_(end_key);
+      Load_();
+    }
+
+    Iter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end,
+         uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), start_key_(start_key)
+    {
+      end_idx_ = blevel_->EndIndex_(end_key);
+      entry_idx_ = blevel_->Find_(start_key, begin, end);
+      Load_();
+    }
+
+    ALWAYS_INLINE uint64_t key() const {
+      return pairs_[pos_].first;
+    }
+
+    ALWAYS_INLINE uint64_t value() const {
+      return pairs_[pos_].second;
+    }
+
+    ALWAYS_INLINE bool next() {
+      if (++pos_ >= pairs_.size()) {
+        Advance_();
+        Load_();
       }
-      if (entry_idx_ >= blevel_->Entries()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
+      return !end();
+    }
+
+    ALWAYS_INLINE bool end() const {
+      return entry_idx_ >= end_idx_;
+    }
+
+   private:
+    const BLevel* blevel_;
+    uint64_t entry_idx_;
+    uint64_t end_idx_;
+    uint64_t start_key_;  // copied pairs are in [start_key_, next_key_)
+    uint64_t next_key_;
+    std::vector<std::pair<uint64_t,uint64_t>> pairs_;
+    size_t pos_;
+
+    ALWAYS_INLINE void Advance_() {
+      if (next_key_ != UINT64_MAX) {
+        start_key_ = next_key_;
+      } else {
+        entry_idx_++;
+        start_key_ = 0;
       }
     }
 
-    Iter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end)
-      : blevel_(blevel), locked_(false)
+    // copy from start_key_, move forward until copied pairs are not empty
+    void Load_() {
+      while (entry_idx_ < end_idx_) {
+        blevel_->PrefetchAhead_(entry_idx_);
+        blevel_->CopyEntry_(entry_idx_, start_key_, pairs_, next_key_);
+        std::sort(pairs_.begin(), pairs_.end());
+        pos_ = 0;
+        if (!pairs_.empty())
+          return;
+        Advance_();
+      }
+    }
+  };
+
+  class NoSortIter {
+   public:
+    NoSortIter(const BLevel* blevel, uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), entry_idx_(0), start_key_(0)
+    {
+      end_idx_ = blevel_->EndIndex_(end_key);
+      Load_();
+    }
+
+    NoSortIter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end,
+               uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), start_key_(start_key)
     {
+      end_idx_ = blevel_->EndIndex_(end_key);
       entry_idx_ = blevel_->Find_(start_key, begin, end);
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-#endif
-      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      while (iter_.end() && ++entry_idx_ < blevel_->Entries()) {
-#ifndef NO_LOCK
-        blevel_->lock_[entry_idx_-1].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-#endif
-        new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
+      Load_();
+    }
+
+    ALWAYS_INLINE uint64_t key() const {
+      return pairs_[pos_].first;
+    }
+
+    ALWAYS_INLINE uint64_t value() const {
+      return pairs_[pos_].second;
+    }
+
+    ALWAYS_INLINE bool next() {
+      if (++pos_ >= pairs_.size()) {
+        Advance_();
+        Load_();
       }
-      if (entry_idx_ >= blevel_->Entries()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
+      return !end();
+    }
+
+    ALWAYS_INLINE bool end() const {
+      return entry_idx_ >= end_idx_;
+    }
+
+   private:
+    const BLevel* blevel_;
+    uint64_t entry_idx_;
+    uint64_t end_idx_;
+    uint64_t start_key_;  // copied pairs are in [start_key_, next_key_)
+    uint64_t next_key_;
+    std::vector<std::pair<uint64_t,uint64_t>> pairs_;
+    size_t pos_;
+
+    ALWAYS_INLINE void Advance_() {
+      if (next_key_ != UINT64_MAX) {
+        start_key_ = next_key_;
+      } else {
+        entry_idx_++;
+        start_key_ = 0;
+      }
+    }
+
+    // copy from start_key_, move forward until copied pairs are not empty
+    void Load_() {
+      while (entry_idx_ < end_idx_) {
+        blevel_->PrefetchAhead_(entry_idx_);
+        blevel_->CopyEntry_(entry_idx_, start_key_, pairs_, next_key_);
+        pos_ = 0;
+        if (!pairs_.empty())
+          return;
+        Advance_();
       }
     }
+  };
+#else
+  class Iter {
+   public:
+    Iter(const BLevel* blevel, uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), entry_idx_(0), locked_(false)
+    {
+      end_idx_ = blevel_->EndIndex_(end_key);
+      if (entry_idx_ >= end_idx_)
+        return;
+      Lock_();
+      blevel_->PrefetchAhead_(entry_idx_);
+      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_,
+                                       blevel_->SortCache_(entry_idx_));
+      SkipEmpty_();
+    }
+
+    Iter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end,
+         uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), locked_(false)
+    {
+      end_idx_ = blevel_->EndIndex_(end_key);
+      entry_idx_ = blevel_->Find_(start_key, begin, end);
+      if (entry_idx_ >= end_idx_)
+        return;
+      Lock_();
+      blevel_->PrefetchAhead_(entry_idx_);
+      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_,
+                                       start_key, blevel_->SortCache_(entry_idx_));
+      SkipEmpty_();
+    }
 
     ~Iter() {
-      if (locked_)
-        blevel_->lock_[entry_idx_].unlock_shared();
+      Unlock_();
     }
 
     ALWAYS_INLINE uint64_t key() const {
@@ -299,85 +594,82 @@ class BLevel {
     }
 
     ALWAYS_INLINE bool next() {
-      if (!iter_.next()) {
-        while (iter_.end() && ++entry_idx_ < blevel_->Entries()) {
-#ifndef NO_LOCK
-          blevel_->lock_[entry_idx_-1].unlock_shared();
-          blevel_->lock_[entry_idx_].lock_shared();
-#endif
-          new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-        }
-        if (entry_idx_ >= blevel_->Entries()) {
-          blevel_->lock_[entry_idx_].unlock_shared();
-          locked_ = false;
-          return false;
-        } else {
-          return true;
-        }
-      } else {
-        return true;
-      }
+      if (!iter_.next())
+        SkipEmpty_();
+      return !end();
     }
 
     ALWAYS_INLINE bool end() const {
-      return entry_idx_ >= blevel_->Entries();
+      return entry_idx_ >= end_idx_;
     }
 
    private:
     const BLevel* blevel_;
     uint64_t entry_idx_;
+    uint64_t end_idx_;
     BLevel::Entry::Iter iter_;
     bool locked_;
-  };
 
-  class NoSortIter {
-   public:
-    NoSortIter(const BLevel* blevel)
-      : blevel_(blevel), entry_idx_(0), locked_(false)
-    {
+    ALWAYS_INLINE void Lock_() {
 #ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
+      blevel_->LockShared_(entry_idx_);
       locked_ = true;
 #endif
-      new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      while (iter_.end() && ++entry_idx_ < blevel_->Entries()) {
+    }
+
+    ALWAYS_INLINE void Unlock_() {
 #ifndef NO_LOCK
-        blevel_->lock_[entry_idx_-1].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-#endif
-        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      }
-      if (entry_idx_ >= blevel_->Entries()) {
+      if (locked_) {
         blevel_->lock_[entry_idx_].unlock_shared();
         locked_ = false;
       }
+#endif
+    }
+
+    // move to the next entry until current entry is not empty
+    ALWAYS_INLINE void SkipEmpty_() {
+      while (iter_.end()) {
+        Unlock_();
+        if (++entry_idx_ >= end_idx_)
+          return;
+        Lock_();
+        blevel_->PrefetchAhead_(entry_idx_);
+        new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_,
+                                       blevel_->SortCache_(entry_idx_));
+      }
     }
+  };
 
-    NoSortIter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end)
+  class NoSortIter {
+   public:
+    NoSortIter(const BLevel* blevel, uint64_t end_key = UINT64_MAX)
+      : blevel_(blevel), entry_idx_(0), locked_(false)
+    {
+      end_idx_ = blevel_->EndIndex_(end_key);
+      if (entry_idx_ >= end_idx_)
+        return;
+      Lock_();
+      blevel_->PrefetchAhead_(entry_idx_);
+      new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
+      SkipEmpty_();
+    }
+
+    NoSortIter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end,
+               uint64_t end_key = UINT64_MAX)
       : blevel_(blevel), locked_(false)
     {
+      end_idx_ = blevel_->EndIndex_(end_key);
       entry_idx_ = blevel_->Find_(start_key, begin, end);
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-#endif
+      if (entry_idx_ >= end_idx_)
+        return;
+      Lock_();
+      blevel_->PrefetchAhead_(entry_idx_);
       new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      while (iter_.end() && ++entry_idx_ < blevel_->Entries()) {
-#ifndef NO_LOCK
-        blevel_->lock_[entry_idx_-1].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-#endif
-        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      }
-      if (entry_idx_ >= blevel_->Entries()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
-      }
+      SkipEmpty_();
     }
 
     ~NoSortIter() {
-      if (locked_)
-        blevel_->lock_[entry_idx_].unlock_shared();
+      Unlock_();
     }
 
     ALWAYS_INLINE uint64_t key() const {
@@ -389,36 +681,51 @@ class BLevel {
     }
 
     ALWAYS_INLINE bool next() {
-      if (!iter_.next()) {
-        while (iter_.end() && ++entry_idx_ < blevel_->Entries()) {
-#ifndef NO_LOCK
-          blevel_->lock_[entry_idx_-1].unlock_shared();
-          blevel_->lock_[entry_idx_].lock_shared();
-#endif
-          new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-        }
-        if (entry_idx_ >= blevel_->Entries()) {
-          blevel_->lock_[entry_idx_].unlock_shared();
-          locked_ = false;
-          return false;
-        } else {
-          return true;
-        }
-      } else {
-        return true;
-      }
+      if (!iter_.next())
+        SkipEmpty_();
+      return !end();
     }
 
     ALWAYS_INLINE bool end() const {
-      return entry_idx_ >= blevel_->Entries();
+      return entry_idx_ >= end_idx_;
     }
 
    private:
     const BLevel* blevel_;
     uint64_t entry_idx_;
+    uint64_t end_idx_;
     BLevel::Entry::NoSortIter iter_;
     bool locked_;
+
+    ALWAYS_INLINE void Lock_() {
+#ifndef NO_LOCK
+      blevel_->LockShared_(entry_idx_);
+      locked_ = true;
+#endif
+    }
+
+    ALWAYS_INLINE void Unlock_() {
+#ifndef NO_LOCK
+      if (locked_) {
+        blevel_->lock_[entry_idx_].unlock_shared();
+        locked_ = false;
+      }
+#endif
+    }
+
+    // move to the next entry until current entry is not empty
+    ALWAYS_INLINE void SkipEmpty_() {
+      while (iter_.end()) {
+        Unlock_();
+        if (++entry_idx_ >= end_idx_)
+          return;
+        Lock_();
+        blevel_->PrefetchAhead_(entry_idx_);
+        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
+      }
+    }
   };
+#endif // OPTIMISTIC_LOCK
 
   friend Test;
 
@@ -428,40 +735,388 @@ class BLevel {
     uint64_t value_buf[BLEVEL_EXPAND_BUF_KEY];
     int buf_count;
     bool zero_entry;
+    bool overflow;  // no room for new entry, put into the last entry
+    bool parallel;  // one of the workers, nr_entries_ is set by caller
+    uint64_t size;  // pairs put, not yet added to size_
     uint64_t clevel_data_count;
     uint64_t clevel_count;
+    std::atomic<uint64_t>* min_key;  // online expansion progress
 
-    ExpandData(Entry* entries) {
+    ExpandData(Entry* entries, std::atomic<uint64_t>* min_key = nullptr) {
       buf_count = 0;
       new_addr = entries;
       zero_entry = true;
+      overflow = false;
+      parallel = false;
+      size = 0;
       clevel_data_count = 0;
       clevel_count = 0;
+      this->min_key = min_key;
     }
 
-    void FlushToEntry(Entry* entry, int prefix_len, CLevel::MemControl* mem);
+    void FlushToEntry(Entry* entry, int prefix_len, CLevel::MemControl* mem,
+                      BloomFilter** filter);
+  };
+
+  // at the beginning of pmem file
+  struct Header {
+    uint64_t magic;       // set when expansion finishes
+    uint64_t nr_entries;
   };
 
+  static const uint64_t MAGIC = 0x626c6576656c3031UL;
+
   // member
   void* pmem_addr_;
   size_t mapped_len_;
   std::string pmem_file_;
   static int file_id_;
+  int id_;
+  bool keep_files_;
+  Header* header_;
 
   uint64_t entries_offset_;                     // pmem file offset
   Entry* __attribute__((aligned(64))) entries_; // current mmaped address
-  size_t nr_entries_;
+  std::atomic<size_t> nr_entries_;
+  size_t max_entries_;
+  // in-memory copy of entries_[i].entry_key, binary search in Find_ only
+  // touches dram and the final entry on pmem.
+  uint64_t* entry_keys_;
   std::atomic<size_t> size_;
+  // online expansion: entries in [0, migrated_entries_) have been moved to
+  // a new blevel, migrated_size_ pairs in total.
+  std::atomic<uint64_t> migrated_entries_;
+  std::atomic<size_t> migrated_size_;
   CLevel::MemControl clevel_mem_;
+#ifdef OPTIMISTIC_LOCK
+  using EntryLock = VersionLock;
+#else
+  using EntryLock = RWSpinLock;
+#endif
 #ifndef NO_LOCK
-  std::shared_mutex* lock_;
+  EntryLock* lock_;
+#endif
+#ifdef BLOOM_FILTER
+  // filter of entry i is allocated when its clevel is set up
+  BloomFilter** filter_;
+#endif
+#ifndef BUF_SORT
+  // sorted order of entry buffers cached by readers
+  std::atomic<uint64_t>* sort_cache_;
+#endif
+#ifdef ASYNC_FLUSH
+  // a full entry buffer is moved to a sealed buffer and merged into clevel
+  // by flush_pool_. sealed_[i] is the sealed buffer of entry i, nullptr if
+  // none. sealed buffers are in their own pmem file, so acknowledged pairs
+  // survive a crash before the merge, they are merged when the blevel is
+  // reopened. sealed buffers are only unmapped with blevel, so readers
+  // without lock never touch freed memory.
+  // foreground merges by itself when all sealed buffers are in use
+  static const int SEALED_BUF_NUM = 1024;
+  struct __attribute__((aligned(64))) SealedBuf {
+    uint64_t entry;             // index of the sealed entry plus one, 0 if free
+    KVBuffer<48+64,8> buf;
+  };
+  void* sealed_addr_;
+  size_t sealed_len_;
+  SealedBuf** sealed_;
+  SealedBuf* sealed_pool_;
+  mutable std::vector<SealedBuf*> free_sealed_;
+  mutable std::mutex sealed_mutex_;
+  ThreadPool* flush_pool_;
 #endif
 
   // function
+  void MapEntries_();
+  void InitVolatile_();
+  void PersistHeader_();
   uint64_t Find_(uint64_t key, uint64_t begin, uint64_t end) const;
+
+  ALWAYS_INLINE BloomFilter** FilterSlot_(uint64_t idx) const {
+#ifdef BLOOM_FILTER
+    return &filter_[idx];
+#else
+    return nullptr;
+#endif
+  }
+
+  ALWAYS_INLINE const BloomFilter* Filter_(uint64_t idx) const {
+#ifdef BLOOM_FILTER
+    return filter_[idx];
+#else
+    return nullptr;
+#endif
+  }
+
+  uint64_t EndIndex_(uint64_t end_key) const;
+  // caller holds the lock of entry idx
+  bool GetLocked_(uint64_t idx, uint64_t key, uint64_t& value) const;
+#if !defined(NO_LOCK) && !defined(OPTIMISTIC_LOCK)
+  // shared lock of entry idx, with no sealed buffer
+  void LockShared_(uint64_t idx) const;
+#endif
+#ifdef ASYNC_FLUSH
+  // caller holds the lock of entry idx
+  void Seal_(uint64_t idx);
+  void MergeSealed_(uint64_t idx) const;
+  // map the sealed buffers, a reopened blevel merges those left by a crash
+  void MapSealed_(bool create);
+  // lock entry idx and merge its sealed buffer if any
+  void HelpMerge_(uint64_t idx) const;
+#endif
+#ifdef OPTIMISTIC_LOCK
+  void CopyEntry_(uint64_t idx, uint64_t start_key,
+                  std::vector<std::pair<uint64_t,uint64_t>>& pairs, uint64_t& next_key) const;
+#endif
+
+  // prefetch for a scan at entry idx moving by step: the entry
+  // SCAN_PREFETCH_DISTANCE entries ahead, and the clevel root of the next
+  // entry, whose entry was prefetched by earlier steps
+  ALWAYS_INLINE void PrefetchAhead_(uint64_t idx, int step = 1) const {
+#if SCAN_PREFETCH_DISTANCE > 0
+    uint64_t ahead = idx + SCAN_PREFETCH_DISTANCE * step;
+    if (ahead < Entries()) {
+      prefetch(&entries_[ahead]);
+      prefetch((const char*)&entries_[ahead] + 64);
+    }
+    uint64_t next = idx + step;
+    if (next < Entries() && entries_[next].clevel.HasSetup())
+      entries_[next].clevel.PrefetchRoot(&clevel_mem_);
+#endif
+  }
+
+  ALWAYS_INLINE std::atomic<uint64_t>* SortCache_(uint64_t idx) const {
+#ifndef BUF_SORT
+    return &sort_cache_[idx];
+#else
+    return nullptr;
+#endif
+  }
+
+#ifdef OPTIMISTIC_LOCK
+  // pairs of entry idx in [min_key, max_key] are copied to pairs a few
+  // leaves at a time, see CopyEntry_(), and fn() is called on every
+  // validated copy. no lock is held when fn() is called.
+  template <typename Fn>
+  void VisitCopies_(uint64_t idx, uint64_t min_key, uint64_t max_key,
+                    std::vector<std::pair<uint64_t,uint64_t>>& pairs, Fn fn) const {
+    // clevel compares suffixes only, keys must have the prefix of entry
+    uint64_t start_key = std::max(min_key, entry_keys_[idx]);
+    while (true) {
+      uint64_t next_key;
+      CopyEntry_(idx, start_key, pairs, next_key);
+      pairs.erase(std::remove_if(pairs.begin(), pairs.end(),
+          [=](const std::pair<uint64_t,uint64_t>& kv) { return kv.first > max_key; }),
+          pairs.end());
+      fn();
+      if (next_key == UINT64_MAX || next_key > max_key)
+        return;
+      start_key = next_key;
+    }
+  }
+#else
+  // buf_fn(buf, prefix_key, all_in_range) on the buffer and the clevel
+  // leaves of entry idx that may have keys in [min_key, max_key], under the
+  // shared lock of entry. leaves are visited in order until buf_fn returns
+  // false, it returns false when buf has a key larger than max_key.
+  // all_in_range is true if all keys of the entry are in range.
+  template <typename BufFn>
+  void VisitEntry_(uint64_t idx, uint64_t min_key, uint64_t max_key, BufFn buf_fn) const {
+    // clevel compares suffixes only, keys must have the prefix of entry
+    min_key = std::max(min_key, entry_keys_[idx]);
+    bool all_in_range = min_key == entry_keys_[idx] &&
+        (idx + 1 < Entries() ? entry_keys_[idx + 1] - 1 <= max_key : max_key == UINT64_MAX);
+#ifndef NO_LOCK
+    LockShared_(idx);
+#endif
+    const Entry& entry = entries_[idx];
+    buf_fn(entry.buf, entry.entry_key, all_in_range);
+    if (entry.clevel.HasSetup()) {
+      entry.clevel.ForEachLeaf(&clevel_mem_, min_key, [&](const KVBuffer<48+64,8>& buf) {
+        return buf_fn(buf, entry.entry_key, all_in_range);
+      });
+    }
+#ifndef NO_LOCK
+    lock_[idx].unlock_shared();
+#endif
+  }
+#endif // OPTIMISTIC_LOCK
+
+  // Scan() of one entry, buffer pairs are merged into the leaves of clevel
+  template <typename Out>
+  size_t ScanEntry_(uint64_t idx, uint64_t min_key, uint64_t max_key, size_t max_size,
+                    Out& out) const {
+    // clevel compares suffixes only, keys must have the prefix of entry
+    min_key = std::max(min_key, entry_keys_[idx]);
+    size_t count = 0;
+    auto emit = [&](uint64_t key, uint64_t value) {
+      if (key > max_key || count >= max_size)
+        return false;
+      out(key, value);
+      count++;
+      return true;
+    };
+#ifdef OPTIMISTIC_LOCK
+    // copies of a few leaves, see CopyEntry_()
+    thread_local std::vector<std::pair<uint64_t,uint64_t>> pairs;
+    uint64_t start_key = min_key;
+    while (true) {
+      uint64_t next_key;
+      CopyEntry_(idx, start_key, pairs, next_key);
+      std::sort(pairs.begin(), pairs.end());
+      for (auto& kv : pairs)
+        if (!emit(kv.first, kv.second))
+          return count;
+      if (next_key == UINT64_MAX)
+        return count;
+      start_key = next_key;
+    }
+#else
+#ifndef NO_LOCK
+    LockShared_(idx);
+#endif
+    const Entry& entry = entries_[idx];
+    uint64_t buf_keys[16];
+    uint64_t buf_values[16];
+    int buf_cnt = entry.buf.entries;
+#ifdef BUF_SORT
+    for (int i = 0; i < buf_cnt; ++i) {
+      buf_keys[i] = entry.key(i);
+      buf_values[i] = entry.value(i);
+    }
+#else
+    int sorted_index[16];
+    entry.buf.GetSortedIndex(sorted_index, sort_cache_[idx], 0);
+    for (int i = 0; i < buf_cnt; ++i) {
+      buf_keys[i] = entry.key(sorted_index[i]);
+      buf_values[i] = entry.value(sorted_index[i]);
+    }
+#endif
+    int buf_idx = 0;
+    while (buf_idx < buf_cnt && buf_keys[buf_idx] < min_key)
+      buf_idx++;
+
+    bool more = true;
+    if (entry.clevel.HasSetup()) {
+      entry.clevel.ScanLeaves(&clevel_mem_, entry.entry_key, min_key,
+          [&](const uint64_t* keys, const uint64_t* values, int n) {
+            for (int i = 0; i < n; ++i) {
+              if (keys[i] < min_key)
+                continue;
+              for (; buf_idx < buf_cnt && buf_keys[buf_idx] < keys[i]; ++buf_idx)
+                if (!emit(buf_keys[buf_idx], buf_values[buf_idx]))
+                  return more = false;
+              if (!emit(keys[i], values[i]))
+                return more = false;
+            }
+            return true;
+          });
+    }
+    for (; more && buf_idx < buf_cnt; ++buf_idx)
+      if (!emit(buf_keys[buf_idx], buf_values[buf_idx]))
+        break;
+#ifndef NO_LOCK
+    lock_[idx].unlock_shared();
+#endif
+    return count;
+#endif // OPTIMISTIC_LOCK
+  }
+
+  // ReverseScan() of one entry
+  template <typename Out>
+  size_t ReverseScanEntry_(uint64_t idx, uint64_t min_key, uint64_t max_key,
+                           size_t max_size, Out& out) const {
+    // clevel compares suffixes only, keys must have the prefix of entry
+    min_key = std::max(min_key, entry_keys_[idx]);
+    if (idx + 1 < Entries())
+      max_key = std::min(max_key, entry_keys_[idx + 1] - 1);
+    if (min_key > max_key)
+      return 0;
+    size_t count = 0;
+    auto emit = [&](uint64_t key, uint64_t value) {
+      if (key < min_key || count >= max_size)
+        return false;
+      out(key, value);
+      count++;
+      return true;
+    };
+#ifdef OPTIMISTIC_LOCK
+    // copies go forward, pairs in [min_key, max_key] are collected first
+    thread_local std::vector<std::pair<uint64_t,uint64_t>> pairs;
+    thread_local std::vector<std::pair<uint64_t,uint64_t>> collected;
+    collected.clear();
+    uint64_t start_key = min_key;
+    while (true) {
+      uint64_t next_key;
+      CopyEntry_(idx, start_key, pairs, next_key);
+      for (auto& kv : pairs)
+        if (kv.first <= max_key)
+          collected.push_back(kv);
+      if (next_key == UINT64_MAX || next_key > max_key)
+        break;
+      start_key = next_key;
+    }
+    std::sort(collected.begin(), collected.end());
+    for (auto it = collected.rbegin(); it != collected.rend(); ++it)
+      if (!emit(it->first, it->second))
+        break;
+    return count;
+#else
+#ifndef NO_LOCK
+    LockShared_(idx);
+#endif
+    const Entry& entry = entries_[idx];
+    uint64_t buf_keys[16];
+    uint64_t buf_values[16];
+    int buf_cnt = entry.buf.entries;
+#ifdef BUF_SORT
+    for (int i = 0; i < buf_cnt; ++i) {
+      buf_keys[i] = entry.key(i);
+      buf_values[i] = entry.value(i);
+    }
+#else
+    int sorted_index[16];
+    entry.buf.GetSortedIndex(sorted_index, sort_cache_[idx], 0);
+    for (int i = 0; i < buf_cnt; ++i) {
+      buf_keys[i] = entry.key(sorted_index[i]);
+      buf_values[i] = entry.value(sorted_index[i]);
+    }
+#endif
+    int buf_idx = buf_cnt - 1;
+    while (buf_idx >= 0 && buf_keys[buf_idx] > max_key)
+      buf_idx--;
+
+    bool more = true;
+    if (entry.clevel.HasSetup()) {
+      entry.clevel.ReverseScanLeaves(&clevel_mem_, entry.entry_key, max_key,
+          [&](const uint64_t* keys, const uint64_t* values, int n) {
+            for (int i = n - 1; i >= 0; --i) {
+              if (keys[i] > max_key)
+                continue;
+              for (; buf_idx >= 0 && buf_keys[buf_idx] > keys[i]; --buf_idx)
+                if (!emit(buf_keys[buf_idx], buf_values[buf_idx]))
+                  return more = false;
+              if (!emit(keys[i], values[i]))
+                return more = false;
+            }
+            return true;
+          });
+    }
+    for (; more && buf_idx >= 0; --buf_idx)
+      if (!emit(buf_keys[buf_idx], buf_values[buf_idx]))
+        break;
+#ifndef NO_LOCK
+    lock_[idx].unlock_shared();
+#endif
+    return count;
+#endif // OPTIMISTIC_LOCK
+  }
+
   void ExpandSetup_(ExpandData& data);
   void ExpandPut_(ExpandData& data, uint64_t key, uint64_t value);
   void ExpandFinish_(ExpandData& data);
+  void ExpandRange_(ExpandData& data, BLevel* old_blevel, uint64_t old_index,
+                    uint64_t skip, Entry* end_addr);
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include "pmem.h"
+
+namespace combotree {
+
+// in-memory bloom filter of one cache line, every key sets 3 of the 512
+// bits. keys can not be removed, a deleted key is a false positive until
+// the filter is rebuilt.
+class __attribute__((aligned(64))) BloomFilter {
+ public:
+  BloomFilter() { Clear(); }
+
+  ALWAYS_INLINE void Clear() {
+    memset(bits_, 0, sizeof(bits_));
+  }
+
+  ALWAYS_INLINE void Add(uint64_t key) {
+    uint64_t hash = Hash_(key);
+    for (int i = 0; i < HASH_NUM; ++i, hash >>= 9)
+      bits_[(hash & 511) / 64] |= 1UL << (hash % 64);
+  }
+
+  // false means key is not added
+  ALWAYS_INLINE bool MayContain(uint64_t key) const {
+    uint64_t hash = Hash_(key);
+    for (int i = 0; i < HASH_NUM; ++i, hash >>= 9)
+      if (!(bits_[(hash & 511) / 64] & (1UL << (hash % 64))))
+        return false;
+    return true;
+  }
+
+ private:
+  static const int HASH_NUM = 3;
+
+  uint64_t bits_[8];
+
+  // murmur3 finalizer
+  ALWAYS_INLINE static uint64_t Hash_(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53UL;
+    key ^= key >> 33;
+    return key;
+  }
+};
+
+static_assert(sizeof(BloomFilter) == 64, "sizeof(BloomFilter) != 64");
+
+} // namespace combotree
@@ -1,10 +1,258 @@
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "combotree_config.h"
 #include "clevel.h"
 
 namespace combotree {
 
-int CLevel::MemControl::file_id_ = 0;
+std::atomic<uint64_t> CLevel::MemControl::next_id_ = 1;
+
+namespace {
+
+const size_t SEGMENT_ALIGN = 2 * 1024 * 1024;
+
+} // anonymous namespace
+
+/******************** CLevel::MemControl ********************/
+CLevel::MemControl::MemControl(std::string pmem_file, size_t max_size, size_t segment_size,
+                               bool create, int thread_num)
+  : pmem_file_(pmem_file), id_(next_id_++), keep_files_(false),
+    segment_size_(segment_size), growing_(false), free_count_(0)
+{
+  assert(segment_size_ % SEGMENT_ALIGN == 0 && segment_size_ > 0);
+#ifndef BUF_SORT
+  sort_cache_ = new std::atomic<uint64_t>[SORT_CACHE_SIZE]();
+#endif
+  // segments are aligned at 2MB for huge page mapping
+  max_size = (max_size + segment_size_ - 1) / segment_size_ * segment_size_;
+  mapped_len_ = max_size + SEGMENT_ALIGN;
+  pmem_addr_ = mmap(nullptr, mapped_len_, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pmem_addr_ == MAP_FAILED) {
+    perror("CLevel::MemControl(): mmap");
+    exit(1);
+  }
+
+  base_addr_ = ((uint64_t)pmem_addr_ + SEGMENT_ALIGN - 1) & ~(SEGMENT_ALIGN - 1);
+  end_addr_ = (uint8_t*)base_addr_ + max_size;
+  mapped_end_ = base_addr_;
+  header_ = (Header*)base_addr_;
+
+  if (create) {
+    // segments left by a previous tree
+    for (int i = 0; std::filesystem::exists(pmem_file_ + "-" + std::to_string(i)); ++i)
+      std::filesystem::remove(pmem_file_ + "-" + std::to_string(i));
+    MapTo_(base_addr_ + segment_size_);
+    header_->magic = MAGIC;
+    header_->used = sizeof(Node);
+    header_->segment_size = segment_size_;
+    flush(header_);
+    fence();
+    cur_addr_ = base_addr_ + sizeof(Node);
+  } else {
+    MapSegment_(0, false);
+    if (header_->magic != MAGIC || header_->segment_size != segment_size_) {
+      fprintf(stderr, "CLevel::MemControl(): %s-0 is not a clevel of segment size %ld\n",
+              pmem_file_.c_str(), segment_size_);
+      exit(1);
+    }
+    cur_addr_ = base_addr_ + header_->used;
+    for (uint64_t i = 1; i * segment_size_ < header_->used; ++i)
+      MapSegment_(i, false);
+    Recover_(thread_num);
+  }
+}
+
+CLevel::MemControl::~MemControl() {
+  {
+    std::lock_guard<std::mutex> lock(launch_mutex_);
+    if (grow_thread_.joinable())
+      grow_thread_.join();
+  }
+  if (pmem_addr_) {
+    munmap(pmem_addr_, mapped_len_);
+    for (uint64_t i = 0; !keep_files_ && i < (mapped_end_ - base_addr_) / segment_size_; ++i)
+      std::filesystem::remove(pmem_file_ + "-" + std::to_string(i));
+  }
+#ifndef BUF_SORT
+  delete[] sort_cache_;
+#endif
+}
+
+// called when a new arena ends at end
+void CLevel::MemControl::Grow_(uintptr_t end) {
+  if (end > (uintptr_t)end_addr_) {
+    fprintf(stderr, "CLevel::MemControl: clevel space is used up\n");
+    exit(1);
+  }
+  if (segment_size_ == 0)
+    return;
+
+  // background thread falls behind
+  if (end > mapped_end_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(grow_mutex_);
+    MapTo_(end);
+  }
+
+  // map the next segment in background
+  if ((uint8_t*)mapped_end_.load() < end_addr_ && !growing_.exchange(true)) {
+    std::lock_guard<std::mutex> lock(launch_mutex_);
+    if (grow_thread_.joinable())
+      grow_thread_.join();
+    grow_thread_ = std::thread([this, end]() {
+      {
+        std::lock_guard<std::mutex> lock(grow_mutex_);
+        MapTo_(std::min(end + segment_size_, (uintptr_t)end_addr_));
+      }
+      growing_.store(false);
+    });
+  }
+}
+
+void CLevel::MemControl::FreeNode(Node* node) {
+  // optimistic readers check type of every node
+  node->type = Node::Type::INVALID;
+  flush(node);
+  fence();
+  std::lock_guard<std::mutex> lock(free_mutex_);
+  free_nodes_.push_back(node);
+  free_count_.store(free_nodes_.size(), std::memory_order_relaxed);
+}
+
+CLevel::Node* CLevel::MemControl::PopFree_() {
+  std::lock_guard<std::mutex> lock(free_mutex_);
+  if (free_nodes_.empty())
+    return nullptr;
+  Node* node = free_nodes_.back();
+  free_nodes_.pop_back();
+  free_count_.store(free_nodes_.size(), std::memory_order_relaxed);
+  return node;
+}
+
+// map segments until end, caller holds grow_mutex_ or is the constructor
+void CLevel::MemControl::MapTo_(uintptr_t end) {
+  while (mapped_end_.load(std::memory_order_relaxed) < end)
+    MapSegment_((mapped_end_.load(std::memory_order_relaxed) - base_addr_) / segment_size_, true);
+}
+
+// map segment index at the end of mapped segments
+void CLevel::MemControl::MapSegment_(uint64_t index, bool create) {
+  uintptr_t addr = base_addr_ + index * segment_size_;
+  assert(addr == mapped_end_.load(std::memory_order_relaxed));
+  std::string file = pmem_file_ + "-" + std::to_string(index);
+  int fd;
+  if (create) {
+    std::filesystem::remove(file);
+    fd = open(file.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd < 0) {
+      perror("CLevel::MemControl::MapSegment_(): open");
+      exit(1);
+    }
+    if (posix_fallocate(fd, 0, segment_size_) != 0) {
+      perror("CLevel::MemControl::MapSegment_(): posix_fallocate");
+      exit(1);
+    }
+  } else {
+    fd = open(file.c_str(), O_RDWR);
+    if (fd < 0) {
+      perror("CLevel::MemControl::MapSegment_(): open");
+      exit(1);
+    }
+  }
+  {
+    // MAP_POPULATE pre-faults the segment
+    void* ret = MAP_FAILED;
+#ifdef MAP_SYNC
+    ret = mmap((void*)addr, segment_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED_VALIDATE | MAP_SYNC | MAP_FIXED | MAP_POPULATE, fd, 0);
+#endif
+    if (ret == MAP_FAILED) {
+      if (index == 0)
+        fprintf(stderr, "CLevel::MemControl::MapSegment_(): %s is not on a DAX file system\n",
+                file.c_str());
+      ret = mmap((void*)addr, segment_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0);
+    }
+    if (ret == MAP_FAILED) {
+      perror("CLevel::MemControl::MapSegment_(): mmap");
+      exit(1);
+    }
+    close(fd);
+    mapped_end_.store(addr + segment_size_, std::memory_order_release);
+  }
+}
+
+// nodes of an arena ending at end may be linked after return
+void CLevel::MemControl::PersistUsed_(uintptr_t end) {
+  uint64_t used = end - base_addr_;
+  uint64_t old = __atomic_load_n(&header_->used, __ATOMIC_RELAXED);
+  while (old < used &&
+         !__atomic_compare_exchange_n(&header_->used, &old, used, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+  flush(&header_->used);
+  fence();
+}
+
+// nodes never handed out, freed nodes and the rest of arenas are INVALID.
+// a crash in KVBuffer::Delete() leaves a half moved entry, a crash in
+// Node::MergeChild() leaves a MERGE node.
+void CLevel::MemControl::Recover_(int thread_num) {
+  uint64_t first = base_addr_ + sizeof(Node);
+  uint64_t nodes = (cur_addr_.load() - first) / sizeof(Node);
+  thread_num = std::max(1, std::min<int>(thread_num, nodes / 1024 + 1));
+  std::vector<std::vector<Node*>> free_nodes(thread_num);
+  std::vector<std::vector<Node*>> merge_logs(thread_num);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      Node* begin = (Node*)first + nodes * t / thread_num;
+      Node* end = (Node*)first + nodes * (t + 1) / thread_num;
+      for (Node* node = begin; node != end; ++node) {
+        if (node->type == Node::Type::LEAF)
+          node->leaf_buf.Recover(&node->fingerprints);
+        else if (node->type == Node::Type::INDEX)
+          node->index_buf.Recover();
+        else if (node->type == Node::Type::MERGE)
+          merge_logs[t].push_back(node);
+        else
+          free_nodes[t].push_back(node);
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  for (auto& f : free_nodes)
+    free_nodes_.insert(free_nodes_.end(), f.begin(), f.end());
+  free_count_.store(free_nodes_.size());
+  for (auto& logs : merge_logs)
+    for (Node* log : logs)
+      RedoMerge_(log);
+}
+
+// right is still in parent until the merge removes its separator. then
+// pairs of right are put into left again, from the entries left had.
+void CLevel::MemControl::RedoMerge_(Node* log) {
+  Node* parent = (Node*)(base_addr_ + log->merge.parent);
+  Node* left = (Node*)(base_addr_ + log->merge.left);
+  Node* right = (Node*)(base_addr_ + log->merge.right);
+  if (right->type != Node::Type::INVALID) {
+    for (int sep = 0; sep < parent->index_buf.entries; ++sep) {
+      if (parent->index_buf.value(sep) != log->merge.right)
+        continue;
+      if (left->type == Node::Type::LEAF)
+        left->leaf_buf.entries = log->merge.left_entries;
+      else
+        left->index_buf.entries = log->merge.left_entries;
+      left->AbsorbRight(right, parent->index_buf.pkey(sep));
+      parent->index_buf.Delete(sep);
+      break;
+    }
+    FreeNode(right);
+  }
+  FreeNode(log);
+}
 
 #ifndef BUF_SORT
 void CLevel::Node::PutChild(MemControl* mem, void* key, const Node* child) {
@@ -12,7 +260,243 @@ void CLevel::Node::PutChild(MemControl* mem, void* key, const Node* child) {
   assert(index_buf.entries < index_buf.max_entries);
   index_buf.Put(index_buf.entries, key, (uint64_t)child - mem->BaseAddr());
 }
-#endif
+
+int CLevel::Node::PutBatch(MemControl* mem, const uint64_t* keys, const uint64_t* values,
+                           int count, Splits& splits, std::vector<PendingSplit>& pending) {
+  if (type == Type::LEAF) {
+
+    // update existing keys in place, collect new keys
+    uint64_t new_keys[MAX_BATCH];
+    uint64_t new_values[MAX_BATCH];
+    int new_cnt = 0;
+    for (int i = 0; i < count; ++i) {
+      bool exist;
+      int pos = leaf_buf.Find(keys[i], exist, &fingerprints);
+      if (exist) {
+        *(uint64_t*)leaf_buf.pvalue(pos) = values[i];
+        flush(leaf_buf.pvalue(pos));
+      } else {
+        new_keys[new_cnt] = keys[i];
+        new_values[new_cnt] = values[i];
+        new_cnt++;
+      }
+    }
+    if (new_cnt == 0) {
+      fence();
+      return 0;
+    }
+
+    // like Put(), a leaf is split when it becomes full
+    int max_cnt = leaf_buf.max_entries - 1;
+    if (leaf_buf.entries + new_cnt <= max_cnt) {
+      leaf_buf.WriteData(leaf_buf.entries, new_keys, new_values, new_cnt, &fingerprints);
+      flush(this);
+      flush((uint8_t*)this+64);
+      fence();
+      leaf_buf.entries += new_cnt;
+      flush(&leaf_buf.meta);
+      fence();
+      return new_cnt;
+    }
+
+    // merge old and new pairs in key order
+    int sorted_index[16];
+    leaf_buf.GetSortedIndex(sorted_index);
+    uint64_t all_keys[16+MAX_BATCH];
+    uint64_t all_values[16+MAX_BATCH];
+    int total = 0;
+    for (int i = 0, j = 0; i < leaf_buf.entries || j < new_cnt; ++total) {
+      if (j == new_cnt ||
+          (i < leaf_buf.entries && leaf_buf.key(sorted_index[i], keys[0]) < new_keys[j])) {
+        all_keys[total] = leaf_buf.key(sorted_index[i], keys[0]);
+        all_values[total] = leaf_buf.value(sorted_index[i]);
+        i++;
+      } else {
+        all_keys[total] = new_keys[j];
+        all_values[total] = new_values[j];
+        j++;
+      }
+    }
+
+    // spread pairs over node_cnt nodes, this node keeps the first part.
+    // new nodes are built from the last one, so that next pointer of a node
+    // always points to a persisted node. this node is not changed until the
+    // new nodes are linked, like Put().
+    int node_cnt = (total + max_cnt - 1) / max_cnt;
+    Node* new_nodes[16];
+    uint8_t next_ptr[6];
+    memcpy(next_ptr, next, sizeof(next));
+    for (int n = node_cnt - 1; n >= 1; --n) {
+      int start = total * n / node_cnt;
+      int end = total * (n + 1) / node_cnt;
+      Node* new_node = mem->NewNode(Type::LEAF, leaf_buf.suffix_bytes);
+      new_node->leaf_buf.WriteData(0, &all_keys[start], &all_values[start], end - start,
+                                   &new_node->fingerprints);
+      new_node->leaf_buf.entries = end - start;
+      memcpy(new_node->next, next_ptr, sizeof(next_ptr));
+      flush(new_node);
+      flush((uint8_t*)new_node+64);
+      uint64_t tmp = (uint64_t)new_node - mem->BaseAddr();
+      memcpy(next_ptr, &tmp, sizeof(next_ptr));
+      new_nodes[n] = new_node;
+    }
+    fence();
+
+    PendingSplit split;
+    split.node = this;
+    split.split_key = all_keys[total / node_cnt];
+    split.next = new_nodes[1];
+    split.count = 0;
+    for (int i = 0; i < new_cnt && new_keys[i] < split.split_key; ++i) {
+      split.key[split.count] = new_keys[i];
+      split.value[split.count] = new_values[i];
+      split.count++;
+    }
+    pending.push_back(split);
+
+    for (int n = 1; n < node_cnt; ++n)
+      splits.Add(all_keys[total * n / node_cnt], new_nodes[n]);
+    return new_cnt;
+
+  } else if (type == Type::INDEX) {
+
+    // hand every run of keys to its child
+    int sorted_index[16];
+    index_buf.GetSortedIndex(sorted_index);
+    Splits child_splits;
+    int inserted = 0;
+    int i = 0;
+    for (int c = 0; c <= index_buf.entries && i < count; ++c) {
+      int j = count;
+      if (c < index_buf.entries) {
+        uint64_t separator = index_buf.key(sorted_index[c], keys[0]);
+        for (j = i; j < count && keys[j] < separator; ++j);
+      }
+      if (j > i) {
+        Node* child = GetChild(c == 0 ? 0 : sorted_index[c-1] + 1, mem->BaseAddr());
+        inserted += child->PutBatch(mem, &keys[i], &values[i], j - i, child_splits, pending);
+        i = j;
+      }
+    }
+    if (child_splits.count != 0)
+      AddChildren(mem, keys[0], child_splits, splits, pending);
+    return inserted;
+
+  } else {
+    assert(0);
+    return 0;
+  }
+}
+
+void CLevel::Node::AddChildren(MemControl* mem, uint64_t prefix, const Splits& children,
+                               Splits& splits, std::vector<PendingSplit>& pending) {
+  assert(type == Type::INDEX);
+  uint64_t children_offset[Splits::MAX_SPLITS];
+  for (int i = 0; i < children.count; ++i)
+    children_offset[i] = (uint64_t)children.node[i] - mem->BaseAddr();
+
+  // like Put(), an index node is split when it becomes full
+  int max_cnt = index_buf.max_entries - 1;
+  if (index_buf.entries + children.count <= max_cnt) {
+    index_buf.WriteData(index_buf.entries, children.key, children_offset, children.count);
+    flush(this);
+    flush((uint8_t*)this+64);
+    fence();
+    index_buf.entries += children.count;
+    flush(&index_buf.meta);
+    fence();
+    return;
+  }
+
+  // merge old and new separators in key order, all_children[i] is the
+  // child on the right of all_keys[i]
+  int sorted_index[16];
+  index_buf.GetSortedIndex(sorted_index);
+  uint64_t all_keys[16+Splits::MAX_SPLITS];
+  uint64_t all_children[16+Splits::MAX_SPLITS];
+  int total = 0;
+  for (int i = 0, j = 0; i < index_buf.entries || j < children.count; ++total) {
+    if (j == children.count ||
+        (i < index_buf.entries && index_buf.key(sorted_index[i], prefix) < children.key[j])) {
+      all_keys[total] = index_buf.key(sorted_index[i], prefix);
+      all_children[total] = index_buf.value(sorted_index[i]);
+      i++;
+    } else {
+      all_keys[total] = children.key[j];
+      all_children[total] = children_offset[j];
+      j++;
+    }
+  }
+
+  // spread total+1 children over node_cnt nodes, this node keeps the first
+  // part and is not changed until the new nodes are linked. the separator
+  // before the first child of a new node goes up.
+  int child_cnt = total + 1;
+  int node_cnt = (child_cnt + max_cnt) / (max_cnt + 1);
+  Node* new_nodes[16];
+  for (int n = 1; n < node_cnt; ++n) {
+    int start = child_cnt * n / node_cnt;
+    int end = child_cnt * (n + 1) / node_cnt;
+    Node* new_node = mem->NewNode(Type::INDEX, index_buf.suffix_bytes);
+    memcpy(new_node->first_child, &all_children[start-1], sizeof(new_node->first_child));
+    new_node->index_buf.WriteData(0, &all_keys[start], &all_children[start], end - start - 1);
+    new_node->index_buf.entries = end - start - 1;
+    flush(new_node);
+    flush((uint8_t*)new_node+64);
+    new_nodes[n] = new_node;
+  }
+  fence();
+
+  PendingSplit split;
+  split.node = this;
+  split.split_key = all_keys[child_cnt / node_cnt - 1];
+  split.next = nullptr;
+  split.count = 0;
+  for (int i = 0; i < children.count && children.key[i] < split.split_key; ++i) {
+    split.key[split.count] = children.key[i];
+    split.value[split.count] = children_offset[i];
+    split.count++;
+  }
+  pending.push_back(split);
+
+  for (int n = 1; n < node_cnt; ++n)
+    splits.Add(all_keys[child_cnt * n / node_cnt - 1], new_nodes[n]);
+}
+
+// delete pairs not less than split_key, then add the new pairs
+template <typename Buf>
+void CLevel::Node::FinishSplitBuf(Buf& buf, const PendingSplit& split, Fingerprints* fp) {
+  int sorted_index[16];
+  buf.GetSortedIndex(sorted_index);
+  int keep = 0;
+  while (keep < buf.entries && buf.key(sorted_index[keep], split.split_key) < split.split_key)
+    keep++;
+  buf.DeleteData(keep, sorted_index, fp);
+
+  if (split.count == 0)
+    return;
+  buf.WriteData(buf.entries, split.key, split.value, split.count, fp);
+  flush(this);
+  flush((uint8_t*)this+64);
+  fence();
+  buf.entries += split.count;
+  flush(&buf.meta);
+  fence();
+}
+
+void CLevel::Node::FinishSplit(const PendingSplit& split, uint64_t base_addr) {
+  if (type == Type::LEAF) {
+    // like Put(), set next pointer before the moved range is deleted
+    SetNext(base_addr, split.next);
+    flush(next);
+    fence();
+    FinishSplitBuf(leaf_buf, split, &fingerprints);
+  } else {
+    FinishSplitBuf(index_buf, split, nullptr);
+  }
+}
+
+#endif // BUF_SORT
 
 // TODO: flush and fence
 // always success (if no exception)
@@ -73,6 +557,9 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
 
     bool exist;
     int pos = index_buf.Find(key, exist);
+    // a key equal to a separator belongs to the right child
+    if (exist)
+      pos++;
     Node* child = GetChild(pos, mem->BaseAddr());
     Node* new_node = child->Put(mem, key, value, this);
     if (new_node != child) {
@@ -124,7 +611,7 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
   if (type == Type::LEAF) {
 
     bool exist;
-    int pos = leaf_buf.Find(key, exist);
+    int pos = leaf_buf.Find(key, exist, &fingerprints);
     if (exist) {
       *(uint64_t*)leaf_buf.pvalue(pos) = value;
       flush(leaf_buf.pvalue(pos));
@@ -132,7 +619,7 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
       return this;
     }
 
-    leaf_buf.Put(pos, key, value);
+    leaf_buf.Put(pos, key, value, &fingerprints);
     if (leaf_buf.entries == leaf_buf.max_entries) {
       // split
       Node* new_node = mem->NewNode(Type::LEAF, leaf_buf.suffix_bytes);
@@ -140,7 +627,8 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
       int sorted_index[32];
       leaf_buf.GetSortedIndex(sorted_index);
       // MoveData(dest, start_pos, entry_count)
-      leaf_buf.CopyData(&new_node->leaf_buf, leaf_buf.entries/2, sorted_index);
+      leaf_buf.CopyData(&new_node->leaf_buf, leaf_buf.entries/2, sorted_index,
+                        &new_node->fingerprints);
       // set next pointer
       memcpy(new_node->next, next, sizeof(next));
       // persist new node
@@ -162,13 +650,13 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
         fence();
 
         SetNext(mem->BaseAddr(), new_node);
-        leaf_buf.DeleteData(leaf_buf.entries/2, sorted_index);
+        leaf_buf.DeleteData(leaf_buf.entries/2, sorted_index, &fingerprints);
         return new_root;
       } else {
         // new_node is sorted now, so key(0) is the node key
         parent->PutChild(mem, new_node->leaf_buf.pkey(0), new_node);
         SetNext(mem->BaseAddr(), new_node);
-        leaf_buf.DeleteData(leaf_buf.entries/2, sorted_index);
+        leaf_buf.DeleteData(leaf_buf.entries/2, sorted_index, &fingerprints);
         return new_node;
       }
     } else {
@@ -230,7 +718,7 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
 bool CLevel::Node::Get(MemControl* mem, uint64_t key, uint64_t& value) const {
   const Node* leaf = FindLeaf(mem, key);
   bool exist;
-  int pos = leaf->leaf_buf.Find(key, exist);
+  int pos = leaf->leaf_buf.Find(key, exist, &leaf->fingerprints);
   if (exist) {
     value = leaf->leaf_buf.value(pos);
     return true;
@@ -239,13 +727,122 @@ bool CLevel::Node::Get(MemControl* mem, uint64_t key, uint64_t& value) const {
   }
 }
 
-bool CLevel::Node::Delete(MemControl* mem, uint64_t key, uint64_t* value) {
+bool CLevel::Node::Update(MemControl* mem, uint64_t key, uint64_t value) {
   Node* leaf = (Node*)FindLeaf(mem, key);
   bool exist;
-  int pos = leaf->leaf_buf.Find(key, exist);
-  if (exist && value)
-    *value = leaf->leaf_buf.value(pos);
-  return exist ? leaf->leaf_buf.Delete(pos) : true;
+  int pos = leaf->leaf_buf.Find(key, exist, &leaf->fingerprints);
+  if (!exist)
+    return false;
+  *(uint64_t*)leaf->leaf_buf.pvalue(pos) = value;
+  flush(leaf->leaf_buf.pvalue(pos));
+  fence();
+  return true;
+}
+
+bool CLevel::Node::MergeChild(MemControl* mem, uint64_t key) {
+  assert(type == Type::INDEX);
+  if (index_buf.entries == 0)
+    return false;
+
+  // position of separators in key order, child i+1 is on the right of
+  // separator i and child 0 is first_child
+  int sorted_index[16];
+#ifdef BUF_SORT
+  for (int i = 0; i < index_buf.entries; ++i)
+    sorted_index[i] = i;
+#else
+  index_buf.GetSortedIndex(sorted_index);
+#endif
+  bool exist;
+  int pos = index_buf.FindLE(key, exist);
+  if (!GetChild(pos+1, mem->BaseAddr())->Underflow())
+    return false;
+  int rank = 0;
+  if (pos >= 0)
+    while (sorted_index[rank++] != pos);
+
+  // merge right into left, then remove the separator of right
+  int left_rank = rank > 0 ? rank - 1 : 0;
+  int sep = sorted_index[left_rank];
+  Node* left = left_rank == 0 ? GetChild(0, mem->BaseAddr())
+                              : GetChild(sorted_index[left_rank-1]+1, mem->BaseAddr());
+  Node* right = GetChild(sep+1, mem->BaseAddr());
+  // merged node is at most 3/4 full of its own type, leaving room for
+  // inserts, or it splits again soon
+  if (left->type == Type::LEAF) {
+    if (left->leaf_buf.entries + right->leaf_buf.entries > left->leaf_buf.max_entries * 3 / 4)
+      return false;
+  } else {
+    if (left->index_buf.entries + 1 + right->index_buf.entries >
+        left->index_buf.max_entries * 3 / 4)
+      return false;
+  }
+
+#ifdef CLEVEL_TEST
+#define MERGE_CRASH_POINT(step) \
+  if (mem->merge_crash_step == (step)) { mem->merge_crash_step = -1; return false; }
+#else
+#define MERGE_CRASH_POINT(step)
+#endif
+
+  // until right is removed from this node, right is reachable and left may
+  // or may not have its pairs. the merge is recorded first, so that
+  // MemControl::Recover_() finishes it after a crash.
+  Node* log = mem->NewNode(Type::MERGE, 8);
+  log->merge.parent = (uint64_t)this - mem->BaseAddr();
+  log->merge.left = (uint64_t)left - mem->BaseAddr();
+  log->merge.right = (uint64_t)right - mem->BaseAddr();
+  log->merge.left_entries = left->type == Type::LEAF ? left->leaf_buf.entries
+                                                    : left->index_buf.entries;
+  flush(log);
+  fence();
+  MERGE_CRASH_POINT(1);
+
+  left->AbsorbRight(right, index_buf.pkey(sep));
+  MERGE_CRASH_POINT(2);
+  index_buf.Delete(sep);
+  MERGE_CRASH_POINT(3);
+  mem->FreeNode(right);
+  MERGE_CRASH_POINT(4);
+  mem->FreeNode(log);
+#undef MERGE_CRASH_POINT
+  return Underflow();
+}
+
+void CLevel::Node::AbsorbRight(const Node* right, const void* sep_key) {
+  if (type == Type::LEAF) {
+    KVBuffer<48+64,8>& dest = leaf_buf;
+    const KVBuffer<48+64,8>& src = right->leaf_buf;
+    // keys of right are larger, so sorted buffer stays sorted
+    for (int i = 0; i < src.entries; ++i) {
+      memcpy(dest.pkey(dest.entries+i), src.pkey(i), src.suffix_bytes);
+      memcpy(dest.pvalue(dest.entries+i), src.pvalue(i), 8);
+#ifdef BUF_FINGERPRINT
+      fingerprints.Set(dest.entries+i, right->fingerprints.Get(i));
+#endif
+    }
+    flush((uint8_t*)this+64);
+    fence();
+    dest.entries += src.entries;
+    memcpy(next, right->next, sizeof(next));
+    flush(this);
+    fence();
+  } else {
+    KVBuffer<48+64,6>& dest = index_buf;
+    const KVBuffer<48+64,6>& src = right->index_buf;
+    // separator of right points to first child of right
+    memcpy(dest.pkey(dest.entries), sep_key, src.suffix_bytes);
+    memcpy(dest.pvalue(dest.entries), right->first_child, 6);
+    for (int i = 0; i < src.entries; ++i) {
+      memcpy(dest.pkey(dest.entries+1+i), src.pkey(i), src.suffix_bytes);
+      memcpy(dest.pvalue(dest.entries+1+i), src.pvalue(i), 6);
+    }
+    flush((uint8_t*)this+64);
+    fence();
+    dest.entries += src.entries + 1;
+    flush(this);
+    fence();
+  }
 }
 
 
@@ -269,6 +866,9 @@ void CLevel::Setup(MemControl* mem, int suffix_len) {
 void CLevel::Setup(MemControl* mem, KVBuffer<48+64,8>& blevel_buf) {
   Node* new_root = mem->NewNode(Node::Type::LEAF, blevel_buf.suffix_bytes);
   memcpy(&new_root->leaf_buf, &blevel_buf, sizeof(blevel_buf));
+#ifdef BUF_FINGERPRINT
+  new_root->leaf_buf.BuildFingerprints(&new_root->fingerprints);
+#endif
   flush(new_root);
   flush((uint8_t*)new_root+64);
 
@@ -280,6 +880,18 @@ void CLevel::Setup(MemControl* mem, KVBuffer<48+64,8>& blevel_buf) {
   fence();
 }
 
+#ifdef OPTIMISTIC_LOCK
+bool CLevel::OptimisticGet(const MemControl* mem, uint64_t key, uint64_t& value, bool& exist) const {
+  const Node* leaf = OptimisticFindLeaf_(mem, key);
+  if (leaf == nullptr)
+    return false;
+  int pos = leaf->leaf_buf.Find(key, exist, &leaf->fingerprints);
+  if (exist)
+    value = leaf->leaf_buf.value(pos);
+  return true;
+}
+#endif // OPTIMISTIC_LOCK
+
 bool CLevel::Put(MemControl* mem, uint64_t key, uint64_t value) {
   Node* old_root = root(mem->BaseAddr());
   Node* new_root = old_root->Put(mem, key, value, nullptr);
@@ -292,4 +904,94 @@ bool CLevel::Put(MemControl* mem, uint64_t key, uint64_t value) {
   return true;
 }
 
+bool CLevel::Delete(MemControl* mem, uint64_t key, uint64_t* value) {
+  static const int MAX_HEIGHT = 32;
+  Node* path[MAX_HEIGHT];
+  int height = 0;
+  Node* leaf = root(mem->BaseAddr());
+  while (leaf->type != Node::Type::LEAF) {
+    assert(leaf->type == Node::Type::INDEX && height < MAX_HEIGHT);
+    path[height++] = leaf;
+    bool exist;
+    int pos = leaf->index_buf.FindLE(key, exist);
+    leaf = leaf->GetChild(pos+1, mem->BaseAddr());
+  }
+
+  bool exist;
+  int pos = leaf->leaf_buf.Find(key, exist, &leaf->fingerprints);
+  if (!exist)
+    return false;
+  if (value)
+    *value = leaf->leaf_buf.value(pos);
+  leaf->leaf_buf.Delete(pos, &leaf->fingerprints);
+
+  // merge from bottom up until a node does not underflow
+  for (int h = height - 1; h >= 0; --h)
+    if (!path[h]->MergeChild(mem, key))
+      break;
+
+  // remove index roots with a single child
+  Node* old_root = root(mem->BaseAddr());
+  Node* new_root = old_root;
+  while (new_root->type == Node::Type::INDEX && new_root->index_buf.entries == 0)
+    new_root = new_root->GetChild(0, mem->BaseAddr());
+  if (new_root != old_root) {
+    uint64_t tmp = (uint64_t)new_root - mem->BaseAddr();
+    memcpy(root_, &tmp, sizeof(root_));
+    flush(&root_);
+    fence();
+    while (old_root != new_root) {
+      Node* child = old_root->GetChild(0, mem->BaseAddr());
+      mem->FreeNode(old_root);
+      old_root = child;
+    }
+  }
+  return true;
+}
+
+int CLevel::PutBatch(MemControl* mem, const uint64_t* keys, const uint64_t* values, int count) {
+  assert(count <= MAX_BATCH);
+  if (count == 0)
+    return 0;
+#ifdef BUF_SORT
+  int inserted = 0;
+  for (int i = 0; i < count; ++i) {
+    uint64_t value;
+    if (!Get(mem, keys[i], value))
+      inserted++;
+    Put(mem, keys[i], values[i]);
+  }
+  return inserted;
+#else
+  Node* old_root = root(mem->BaseAddr());
+  Node::Splits splits;
+  std::vector<Node::PendingSplit> pending;
+  int inserted = old_root->PutBatch(mem, keys, values, count, splits, pending);
+
+  // grow new roots until no node is split
+  Node* new_root = old_root;
+  while (splits.count != 0) {
+    Node* node = mem->NewNode(Node::Type::INDEX, new_root->leaf_buf.suffix_bytes);
+    uint64_t tmp = (uint64_t)new_root - mem->BaseAddr();
+    memcpy(node->first_child, &tmp, sizeof(node->first_child));
+    Node::Splits upper_splits;
+    node->AddChildren(mem, keys[0], splits, upper_splits, pending);
+    splits = upper_splits;
+    new_root = node;
+  }
+
+  if (old_root != new_root) {
+    new_root = (Node*)((uint64_t)new_root - mem->BaseAddr());
+    memcpy(root_, &new_root, sizeof(root_));
+    flush(&root_);
+    fence();
+  }
+
+  // all new nodes are linked now, parents are finished before their children
+  for (auto it = pending.rbegin(); it != pending.rend(); ++it)
+    it->node->FinishSplit(*it, mem->BaseAddr());
+  return inserted;
+#endif // BUF_SORT
+}
+
 } // namespace combotree
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include <libpmem.h>
 #include <filesystem>
 #include <atomic>
+#include <vector>
+#include <mutex>
+#include <thread>
 #include "kvbuffer.h"
 #include "combotree_config.h"
 #include "debug.h"
@@ -27,10 +30,11 @@ class __attribute__((packed)) CLevel {
       INVALID,
       INDEX,
       LEAF,
+      MERGE,                        // record of a merge, see MergeChild()
     };
 
     Type type;
-    uint8_t __padding[7];           // not used
+    Fingerprints fingerprints;      // used when type == LEAF and BUF_FINGERPRINT
     union {
       // uint48_t
       uint8_t next[6];              // used when type == LEAF. LSB == 1 means NULL
@@ -40,13 +44,69 @@ class __attribute__((packed)) CLevel {
       // contains 2 bytes meta
       KVBuffer<48+64,8> leaf_buf;   // used when type == LEAF
       KVBuffer<48+64,6> index_buf;  // used when type == INDEX
+      struct __attribute__((packed)) {  // used when type == MERGE, node offsets
+        uint64_t parent;
+        uint64_t left;
+        uint64_t right;
+        uint8_t left_entries;
+      } merge;
     };
 
     Node* Put(MemControl* mem, uint64_t key, uint64_t value, Node* parent);
     bool Get(MemControl* mem, uint64_t key, uint64_t& value) const;
-    bool Delete(MemControl* mem, uint64_t key, uint64_t* value);
+    bool Update(MemControl* mem, uint64_t key, uint64_t value);
+    // merge the underflowing child of key with its sibling, the right one
+    // of the two is freed. return true if this node underflows then.
+    bool MergeChild(MemControl* mem, uint64_t key);
+    // append pairs of right sibling, sep_key is the separator of right in
+    // parent, used when type == INDEX
+    void AbsorbRight(const Node* right, const void* sep_key);
+
+    // less than a quarter full, shared by leaf and index nodes
+    ALWAYS_INLINE bool Underflow() const {
+      return leaf_buf.entries * 4 <= leaf_buf.max_entries;
+    }
 #ifndef BUF_SORT
     void PutChild(MemControl* mem, void* key, const Node* child);
+
+    // nodes split from a node by PutBatch, in key order
+    struct Splits {
+      static const int MAX_SPLITS = 32;
+      int count;
+      uint64_t key[MAX_SPLITS];
+      Node* node[MAX_SPLITS];
+
+      Splits() : count(0) {}
+
+      ALWAYS_INLINE void Add(uint64_t split_key, Node* split_node) {
+        assert(count < MAX_SPLITS);
+        key[count] = split_key;
+        node[count] = split_node;
+        count++;
+      }
+    };
+
+    // a node split by PutBatch keeps all its pairs until the new nodes are
+    // linked to the tree, then FinishSplit() deletes pairs not less than
+    // split_key and adds the new pairs of its own part.
+    struct PendingSplit {
+      Node* node;
+      uint64_t split_key;
+      Node* next;                   // first new node, leaf only
+      int count;
+      uint64_t key[Splits::MAX_SPLITS];
+      uint64_t value[Splits::MAX_SPLITS];
+    };
+
+    // keys are sorted and belong to this node. return the number of new keys
+    int PutBatch(MemControl* mem, const uint64_t* keys, const uint64_t* values,
+                 int count, Splits& splits, std::vector<PendingSplit>& pending);
+    // add children of an index node, nodes split from it are added to splits
+    void AddChildren(MemControl* mem, uint64_t prefix, const Splits& children,
+                     Splits& splits, std::vector<PendingSplit>& pending);
+    void FinishSplit(const PendingSplit& split, uint64_t base_addr);
+    template <typename Buf>
+    void FinishSplitBuf(Buf& buf, const PendingSplit& split, Fingerprints* fp);
 #endif
 
     ALWAYS_INLINE Node* GetChild(int pos, uint64_t base_addr) const {
@@ -60,6 +120,22 @@ class __attribute__((packed)) CLevel {
       return (next[0] & 0x1) ? nullptr : (Node*)(READ_SIX_BYTE(next)+base_addr);
     }
 
+    // both cache lines of the node
+    ALWAYS_INLINE void Prefetch() const {
+      prefetch(this);
+      prefetch((const char*)this + 64);
+    }
+
+    // the next leaf is only known from this leaf, so leaf walks prefetch
+    // one leaf ahead
+    ALWAYS_INLINE void PrefetchNext(uint64_t base_addr) const {
+#if SCAN_PREFETCH_DISTANCE > 0
+      const Node* next_leaf = GetNext(base_addr);
+      if (next_leaf)
+        next_leaf->Prefetch();
+#endif
+    }
+
     ALWAYS_INLINE void SetNext(uint64_t base_addr, Node* next_ptr) {
       uint64_t tmp = (uint64_t)next_ptr - base_addr;
       memcpy(next, &tmp, sizeof(next));
@@ -92,46 +168,43 @@ class __attribute__((packed)) CLevel {
   // allocate and persist clevel node
   class MemControl {
    public:
+    // fixed region of size bytes
     MemControl(void* base_addr, size_t size)
       : pmem_file_(""), pmem_addr_(0), base_addr_((uint64_t)base_addr),
-        cur_addr_((uintptr_t)base_addr), end_addr_((uint8_t*)base_addr+size)
-    {}
-
-    MemControl(std::string pmem_file, size_t file_size)
-      : pmem_file_(pmem_file+std::to_string(file_id_++))
+        cur_addr_((uintptr_t)base_addr), end_addr_((uint8_t*)base_addr+size),
+        id_(next_id_++), header_(nullptr), keep_files_(false), segment_size_(0),
+        mapped_end_((uintptr_t)base_addr+size), growing_(false), free_count_(0)
     {
-      int is_pmem;
-      std::filesystem::remove(pmem_file_);
-      pmem_addr_ = pmem_map_file(pmem_file_.c_str(), file_size + 64,
-                   PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len_, &is_pmem);
-      assert(is_pmem == 1);
-      if (pmem_addr_ == nullptr) {
-        perror("CLevel::MemControl(): pmem_map_file");
-        exit(1);
-      }
-
-      // aligned at 64-bytes
-      base_addr_ = (uint64_t)pmem_addr_;
-      if ((base_addr_ & (uintptr_t)63) != 0) {
-        // not aligned
-        base_addr_ = (base_addr_+64) & ~(uintptr_t)63;
-      }
-
-      cur_addr_ = base_addr_;
-      end_addr_ = (uint8_t*)pmem_addr_ + mapped_len_;
+#ifndef BUF_SORT
+      sort_cache_ = new std::atomic<uint64_t>[SORT_CACHE_SIZE]();
+#endif
     }
 
-    ~MemControl() {
-      if (pmem_addr_) {
-        pmem_unmap(pmem_addr_, mapped_len_);
-        std::filesystem::remove(pmem_file_);
-      }
-    }
+    // max_size bytes of address space are reserved, pmem files
+    // pmem_file-0, pmem_file-1, ... of segment_size bytes are mapped into
+    // it on demand. offsets of nodes never change. if create is false,
+    // existing files are mapped and nodes are recovered by thread_num
+    // threads.
+    MemControl(std::string pmem_file, size_t max_size, size_t segment_size,
+               bool create = true, int thread_num = 1);
+    ~MemControl();
+
+    // pmem files are not removed by destructor
+    void KeepFiles() { keep_files_ = true; }
+
+#ifdef CLEVEL_TEST
+    // MergeChild() returns after this persist step, as if it crashed
+    // there, and sets it to -1. 0 means never.
+    int merge_crash_step = 0;
+#endif
 
     CLevel::Node* NewNode(Node::Type type, int suffix_len) {
       assert(suffix_len > 0 && suffix_len <= 8);
-      assert((uint8_t*)cur_addr_.load() + sizeof(CLevel::Node) < end_addr_);
-      CLevel::Node* ret = (CLevel::Node*)cur_addr_.fetch_add(sizeof(CLevel::Node));
+      CLevel::Node* ret = nullptr;
+      if (free_count_.load(std::memory_order_relaxed) != 0)
+        ret = PopFree_();
+      if (ret == nullptr)
+        ret = (CLevel::Node*)AllocNode_();
       ret->type = type;
       ret->leaf_buf.suffix_bytes = suffix_len;
       ret->leaf_buf.prefix_bytes = 8 - suffix_len;
@@ -144,18 +217,134 @@ class __attribute__((packed)) CLevel {
       return base_addr_;
     }
 
+    // node is no longer reachable, it is reused by NewNode()
+    void FreeNode(Node* node);
+
+    // include the unused part of thread arenas, exclude freed nodes
     uint64_t Usage() const {
-      return (uint64_t)cur_addr_.load() - base_addr_;
+      return (uint64_t)cur_addr_.load() - base_addr_ - FreeUsage();
+    }
+
+    // bytes of freed nodes
+    uint64_t FreeUsage() const {
+      return free_count_.load() * sizeof(CLevel::Node);
+    }
+
+#ifndef BUF_SORT
+    // sorted order of a leaf, reusing the order cached by earlier readers
+    ALWAYS_INLINE int GetSortedIndex(const Node* leaf, int sorted_index[]) const {
+      uint64_t n = ((uint64_t)leaf - base_addr_) / sizeof(CLevel::Node);
+      return leaf->leaf_buf.GetSortedIndex(sorted_index,
+          sort_cache_[n & (SORT_CACHE_SIZE - 1)], n / SORT_CACHE_SIZE);
+    }
+#endif
+
+    // addr points to a node allocated from this MemControl
+    ALWAYS_INLINE bool IsNode(const void* addr) const {
+      return (uint64_t)addr >= base_addr_ &&
+             (uint64_t)addr < cur_addr_.load(std::memory_order_relaxed) &&
+             (uint64_t)addr < mapped_end_.load(std::memory_order_acquire) &&
+             ((uint64_t)addr - base_addr_) % sizeof(CLevel::Node) == 0;
     }
 
    private:
+    // a thread allocates nodes from its own arena of ARENA_NODES nodes, so
+    // threads do not contend on cur_addr_ and nodes of a thread stay
+    // contiguous on media. a thread keeps arenas of THREAD_ARENAS
+    // MemControls, e.g. old and new blevel during expansion.
+    static const int ARENA_NODES = 64;
+    static const int THREAD_ARENAS = 4;
+
+    struct Arena {
+      uint64_t owner; // id_ of MemControl, 0 means unused
+      uintptr_t cur;
+      uintptr_t end;
+    };
+
+    // in the first node of a file backed region
+    struct Header {
+      uint64_t magic;
+      uint64_t used;          // persisted high water of cur_addr_, offset
+      uint64_t segment_size;
+    };
+
+    static const uint64_t MAGIC = 0x636c6576656c3031UL;
+
     std::string pmem_file_;
     void* pmem_addr_;
     size_t mapped_len_;
     uint64_t base_addr_;
     std::atomic<uintptr_t> cur_addr_;
     void* end_addr_;
-    static int file_id_;
+    uint64_t id_;
+    static std::atomic<uint64_t> next_id_;
+    Header* header_;                // nullptr if fixed region
+    bool keep_files_;
+
+    // segments are mapped in [base_addr_, mapped_end_). a thread getting
+    // close to mapped_end_ maps the next segment in background, so that
+    // it is pre-faulted before any node is allocated from it.
+    size_t segment_size_;           // 0 means fixed region
+    std::atomic<uintptr_t> mapped_end_;
+    std::mutex grow_mutex_;         // held while mapping segments
+    std::mutex launch_mutex_;       // protects grow_thread_
+    std::atomic<bool> growing_;
+    std::thread grow_thread_;
+
+    void Grow_(uintptr_t end);
+    void MapTo_(uintptr_t end);
+    void MapSegment_(uint64_t index, bool create);
+    void PersistUsed_(uintptr_t end);
+    // repair nodes and collect unused nodes after restart
+    void Recover_(int thread_num);
+    // finish a merge recorded by MergeChild()
+    void RedoMerge_(Node* log);
+
+    // freed nodes in dram, they are lost after crash
+    std::vector<CLevel::Node*> free_nodes_;
+    std::atomic<uint64_t> free_count_;
+    std::mutex free_mutex_;
+
+    CLevel::Node* PopFree_();
+
+#ifndef BUF_SORT
+    // direct mapped dram cache of leaf sorted orders, indexed by node
+    // offset. a stale or colliding order fails validation in
+    // KVBuffer::GetSortedIndex() and is rebuilt.
+    static const size_t SORT_CACHE_SIZE = 1 << 16;
+    std::atomic<uint64_t>* sort_cache_;
+#endif
+
+    ALWAYS_INLINE uintptr_t AllocNode_() {
+      thread_local Arena arenas[THREAD_ARENAS] = {};
+      thread_local int victim = 0;
+      Arena* arena = nullptr;
+      for (int i = 0; i < THREAD_ARENAS; ++i) {
+        if (arenas[i].owner == id_) {
+          arena = &arenas[i];
+          break;
+        }
+      }
+      if (arena == nullptr) {
+        // the rest of the replaced arena is not used
+        arena = &arenas[victim];
+        victim = (victim + 1) % THREAD_ARENAS;
+        arena->owner = id_;
+        arena->cur = arena->end = 0;
+      }
+      if (arena->cur == arena->end) {
+        const size_t arena_size = ARENA_NODES * sizeof(CLevel::Node);
+        arena->cur = cur_addr_.fetch_add(arena_size);
+        arena->end = arena->cur + arena_size;
+        if (arena->end + segment_size_ / 2 > mapped_end_.load(std::memory_order_acquire))
+          Grow_(arena->end);
+        if (header_)
+          PersistUsed_(arena->end);
+      }
+      uintptr_t ret = arena->cur;
+      arena->cur += sizeof(CLevel::Node);
+      return ret;
+    }
   };
 
   class Iter {
@@ -174,7 +363,7 @@ class __attribute__((packed)) CLevel {
         idx_ = cur_->leaf_buf.FindLE(start_key, exist);
         idx_ = exist ? idx_ : idx_ + 1;
 #else
-        cur_->leaf_buf.GetSortedIndex(sorted_index_);
+        mem_->GetSortedIndex(cur_, sorted_index_);
         for (idx_ = 0; idx_ < cur_->leaf_buf.entries; ++idx_)
           if (cur_->leaf_buf.key(sorted_index_[idx_], prefix_key) >= start_key)
             break;
@@ -185,10 +374,11 @@ class __attribute__((packed)) CLevel {
           } while (cur_ != nullptr && cur_->leaf_buf.Empty());
           idx_ = 0;
 #ifndef BUF_SORT
-          if (cur_) cur_->leaf_buf.GetSortedIndex(sorted_index_);
+          if (cur_) mem_->GetSortedIndex(cur_, sorted_index_);
 #endif
         }
       }
+      if (cur_) cur_->PrefetchNext(mem_->BaseAddr());
     }
 
     Iter(const CLevel* clevel, const MemControl* mem, uint64_t prefix_key)
@@ -199,8 +389,9 @@ class __attribute__((packed)) CLevel {
         cur_ = (const Node*)cur_->GetNext(mem_->BaseAddr());
       idx_ = 0;
 #ifndef BUF_SORT
-      if (cur_) cur_->leaf_buf.GetSortedIndex(sorted_index_);
+      if (cur_) mem_->GetSortedIndex(cur_, sorted_index_);
 #endif
+      if (cur_) cur_->PrefetchNext(mem_->BaseAddr());
     }
 
     ALWAYS_INLINE uint64_t key() const {
@@ -227,8 +418,9 @@ class __attribute__((packed)) CLevel {
           cur_ = (const Node*)cur_->GetNext(mem_->BaseAddr());
         } while (cur_ != nullptr && cur_->leaf_buf.Empty());
         idx_ = 0;
+        if (cur_) cur_->PrefetchNext(mem_->BaseAddr());
 #ifndef BUF_SORT
-        if (cur_) cur_->leaf_buf.GetSortedIndex(sorted_index_);
+        if (cur_) mem_->GetSortedIndex(cur_, sorted_index_);
 #endif
         return cur_ == nullptr ? false : true;
       } else {
@@ -261,6 +453,7 @@ class __attribute__((packed)) CLevel {
       while (cur_ != nullptr && cur_->leaf_buf.Empty())
         cur_ = (const Node*)cur_->GetNext(mem_->BaseAddr());
       idx_ = 0;
+      if (cur_) cur_->PrefetchNext(mem_->BaseAddr());
     }
 
     NoSortIter(const CLevel* clevel, const MemControl* mem, uint64_t prefix_key)
@@ -270,6 +463,7 @@ class __attribute__((packed)) CLevel {
       while (cur_ != nullptr && cur_->leaf_buf.Empty())
         cur_ = (const Node*)cur_->GetNext(mem_->BaseAddr());
       idx_ = 0;
+      if (cur_) cur_->PrefetchNext(mem_->BaseAddr());
     }
 
     ALWAYS_INLINE uint64_t key() const {
@@ -288,6 +482,7 @@ class __attribute__((packed)) CLevel {
           cur_ = (const Node*)cur_->GetNext(mem_->BaseAddr());
         } while (cur_ != nullptr && cur_->leaf_buf.Empty());
         idx_ = 0;
+        if (cur_) cur_->PrefetchNext(mem_->BaseAddr());
         return cur_ == nullptr ? false : true;
       } else {
         return true;
@@ -307,17 +502,161 @@ class __attribute__((packed)) CLevel {
 
   CLevel();
   ALWAYS_INLINE bool HasSetup() const { return !(root_[0] & 1); };
+  // root node, the first leaf if clevel has one level
+  ALWAYS_INLINE void PrefetchRoot(const MemControl* mem) const {
+    root(mem->BaseAddr())->Prefetch();
+  }
   void Setup(MemControl* mem, int suffix_len);
   void Setup(MemControl* mem, KVBuffer<48+64,8>& buf);
   bool Put(MemControl* mem, uint64_t key, uint64_t value);
+  // put sorted pairs with one traversal, every modified node is persisted
+  // once. return the number of new keys. with BUF_SORT the pairs are put
+  // one by one.
+  static const int MAX_BATCH = 16;
+  int PutBatch(MemControl* mem, const uint64_t* keys, const uint64_t* values, int count);
 
   ALWAYS_INLINE bool Get(MemControl* mem, uint64_t key, uint64_t& value) const {
     return root(mem->BaseAddr())->Get(mem, key, value);
   }
 
-  ALWAYS_INLINE bool Delete(MemControl* mem, uint64_t key, uint64_t* value) {
-    return root(mem->BaseAddr())->Delete(mem, key, value);
+  // return false if key does not exist
+  ALWAYS_INLINE bool Update(MemControl* mem, uint64_t key, uint64_t value) {
+    return root(mem->BaseAddr())->Update(mem, key, value);
+  }
+
+  // return false if key does not exist. underflowing nodes are merged
+  // with their siblings and freed.
+  bool Delete(MemControl* mem, uint64_t key, uint64_t* value);
+
+  static const int MAX_LEAF_ENTRIES = (48+64) / 9;
+
+  // leaf_fn(keys, values, n) is called on the sorted pairs of every
+  // non-empty leaf in order, starting from the leaf of start_key, until it
+  // returns false.
+  template <typename LeafFn>
+  void ScanLeaves(const MemControl* mem, uint64_t prefix_key, uint64_t start_key,
+                  LeafFn leaf_fn) const {
+    uint64_t keys[MAX_LEAF_ENTRIES];
+    uint64_t values[MAX_LEAF_ENTRIES];
+    const Node* leaf = root(mem->BaseAddr())->FindLeaf(mem, start_key);
+    for (; leaf != nullptr; leaf = leaf->GetNext(mem->BaseAddr())) {
+      leaf->PrefetchNext(mem->BaseAddr());
+      const KVBuffer<48+64,8>& buf = leaf->leaf_buf;
+      if (buf.Empty())
+        continue;
+#ifdef BUF_SORT
+      for (int i = 0; i < buf.entries; ++i) {
+        keys[i] = buf.key(i, prefix_key);
+        values[i] = buf.value(i);
+      }
+#else
+      int sorted_index[MAX_LEAF_ENTRIES];
+      mem->GetSortedIndex(leaf, sorted_index);
+      for (int i = 0; i < buf.entries; ++i) {
+        keys[i] = buf.key(sorted_index[i], prefix_key);
+        values[i] = buf.value(sorted_index[i]);
+      }
+#endif
+      if (!leaf_fn(keys, values, buf.entries))
+        return;
+    }
+  }
+
+  // buf_fn(leaf_buf) on every non-empty leaf in order, starting from the
+  // leaf of start_key, until it returns false. keys of a leaf stay unsorted.
+  template <typename BufFn>
+  void ForEachLeaf(const MemControl* mem, uint64_t start_key, BufFn buf_fn) const {
+    const Node* leaf = root(mem->BaseAddr())->FindLeaf(mem, start_key);
+    for (; leaf != nullptr; leaf = leaf->GetNext(mem->BaseAddr())) {
+      leaf->PrefetchNext(mem->BaseAddr());
+      if (!leaf->leaf_buf.Empty() && !buf_fn(leaf->leaf_buf))
+        return;
+    }
+  }
+
+  // like ScanLeaves(), but leaves are visited in descending order from
+  // the leaf of start_key. leaves have no prev pointer, the previous leaf
+  // is the leaf of the lower bound of current leaf minus one, the lower
+  // bound is the last index key followed from root.
+  template <typename LeafFn>
+  void ReverseScanLeaves(const MemControl* mem, uint64_t prefix_key, uint64_t start_key,
+                         LeafFn leaf_fn) const {
+    uint64_t keys[MAX_LEAF_ENTRIES];
+    uint64_t values[MAX_LEAF_ENTRIES];
+    uint64_t key = start_key;
+    while (true) {
+      const Node* leaf = root(mem->BaseAddr());
+      bool has_low = false;
+      uint64_t low = 0;
+      while (leaf->type != Node::Type::LEAF) {
+        assert(leaf->type != Node::Type::INVALID);
+        bool exist;
+        int pos = leaf->index_buf.FindLE(key, exist);
+        if (pos >= 0) {
+          has_low = true;
+          low = leaf->index_buf.key(pos, prefix_key);
+        }
+        leaf = leaf->GetChild(pos + 1, mem->BaseAddr());
+      }
+      const KVBuffer<48+64,8>& buf = leaf->leaf_buf;
+      if (!buf.Empty()) {
+#ifdef BUF_SORT
+        for (int i = 0; i < buf.entries; ++i) {
+          keys[i] = buf.key(i, prefix_key);
+          values[i] = buf.value(i);
+        }
+#else
+        int sorted_index[MAX_LEAF_ENTRIES];
+        mem->GetSortedIndex(leaf, sorted_index);
+        for (int i = 0; i < buf.entries; ++i) {
+          keys[i] = buf.key(sorted_index[i], prefix_key);
+          values[i] = buf.value(sorted_index[i]);
+        }
+#endif
+        if (!leaf_fn(keys, values, buf.entries))
+          return;
+      }
+      if (!has_low || low == 0)
+        return;
+      key = low - 1;
+    }
+  }
+
+#ifdef OPTIMISTIC_LOCK
+  // read without lock, the caller validates the result with entry version.
+  // return false if the clevel is found being modified.
+  bool OptimisticGet(const MemControl* mem, uint64_t key, uint64_t& value, bool& exist) const;
+
+  // append pairs of at most max_leaf leaves to pairs in no particular order,
+  // starting from the leaf of start_key. next_key is set to the smallest key
+  // after these leaves, UINT64_MAX if no more. check() is called on every
+  // leaf, return false if it fails or clevel is found being modified.
+  template <typename Check>
+  bool OptimisticCopy(const MemControl* mem, uint64_t prefix_key, uint64_t start_key,
+                      int max_leaf, std::vector<std::pair<uint64_t,uint64_t>>& pairs,
+                      uint64_t& next_key, Check check) const {
+    const Node* leaf = OptimisticFindLeaf_(mem, start_key);
+    if (leaf == nullptr)
+      return false;
+    int leaf_cnt = 0;
+    next_key = UINT64_MAX;
+    while (leaf != nullptr) {
+      if (!mem->IsNode(leaf) || leaf->type != Node::Type::LEAF || !check())
+        return false;
+      if (leaf_cnt < max_leaf) {
+        for (int i = 0; i < leaf->leaf_buf.entries; ++i)
+          pairs.emplace_back(leaf->leaf_buf.key(i, prefix_key), leaf->leaf_buf.value(i));
+        leaf_cnt++;
+      } else if (!leaf->leaf_buf.Empty()) {
+        for (int i = 0; i < leaf->leaf_buf.entries; ++i)
+          next_key = std::min(next_key, leaf->leaf_buf.key(i, prefix_key));
+        return true;
+      }
+      leaf = leaf->GetNext(mem->BaseAddr());
+    }
+    return true;
   }
+#endif // OPTIMISTIC_LOCK
 
  private:
   struct Node;
@@ -325,8 +664,32 @@ class __attribute__((packed)) CLevel {
   uint8_t root_[6]; // uint48_t, LSB == 1 means NULL
 
   ALWAYS_INLINE Node* root(uint64_t base_addr) const {
-    return (Node*)(READ_SIX_BYTE(root_) + base_addr);
+    // a clevel may be a stand-alone 6-byte object, do not read past it
+    uint64_t offset = 0;
+    memcpy(&offset, root_, sizeof(root_));
+    return (Node*)(offset + base_addr);
+  }
+
+#ifdef OPTIMISTIC_LOCK
+  // like Node::FindLeaf(), but every node is checked since the offsets
+  // may be torn by writers. return nullptr on failure.
+  ALWAYS_INLINE const Node* OptimisticFindLeaf_(const MemControl* mem, uint64_t key) const {
+    const Node* node = root(mem->BaseAddr());
+    // bounds the traversal if torn offsets make a cycle
+    for (int depth = 0; depth < 64; ++depth) {
+      if (!mem->IsNode(node))
+        return nullptr;
+      if (node->type == Node::Type::LEAF)
+        return node;
+      if (node->type != Node::Type::INDEX)
+        return nullptr;
+      bool exist;
+      int pos = node->index_buf.FindLE(key, exist);
+      node = node->GetChild(pos + 1, mem->BaseAddr());
+    }
+    return nullptr;
   }
+#endif // OPTIMISTIC_LOCK
 };
 
 static_assert(sizeof(CLevel) == 6, "sizeof(CLevel) != 6");
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <filesystem>
 #include <thread>
 #include <memory>
@@ -9,6 +10,7 @@
 #include "blevel.h"
 #include "manifest.h"
 #include "pmemkv.h"
+#include "thread_pool.h"
 #include "debug.h"
 
 namespace combotree {
@@ -16,14 +18,59 @@ namespace combotree {
 std::mutex log_mutex;
 int64_t expand_time = 0;
 
+namespace {
+
+// stable sort by key. parts are sorted by thread_num threads, then
+// adjacent runs are merged in parallel until one run is left.
+void ParallelSort(std::vector<std::pair<uint64_t,uint64_t>>& pairs, int thread_num) {
+  auto less = [](const std::pair<uint64_t,uint64_t>& a,
+                 const std::pair<uint64_t,uint64_t>& b) { return a.first < b.first; };
+  thread_num = std::max(1, std::min<int>(thread_num, pairs.size() / 4096 + 1));
+  std::vector<size_t> bound(thread_num + 1);
+  for (int t = 0; t <= thread_num; ++t)
+    bound[t] = pairs.size() * t / thread_num;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t)
+    threads.emplace_back([&, t]() {
+      std::stable_sort(pairs.begin() + bound[t], pairs.begin() + bound[t+1], less);
+    });
+  for (auto& t : threads)
+    t.join();
+
+  for (int width = 1; width < thread_num; width *= 2) {
+    threads.clear();
+    for (int t = 0; t + width < thread_num; t += 2 * width) {
+      size_t mid = bound[t + width];
+      size_t end = bound[std::min(t + 2 * width, thread_num)];
+      threads.emplace_back([&, t, mid, end]() {
+        std::inplace_merge(pairs.begin() + bound[t], pairs.begin() + mid,
+                           pairs.begin() + end, less);
+      });
+    }
+    for (auto& t : threads)
+      t.join();
+  }
+}
+
+} // anonymous namespace
+
 ComboTree::ComboTree(std::string pool_dir, size_t pool_size, bool create)
     : pool_dir_(pool_dir), pool_size_(pool_size),
       expand_min_key_(0), expand_max_key_(0), permit_delete_(true)
 {
   ValidPoolDir_();
-  manifest_ = new Manifest(pool_dir_);
-  pmemkv_ = std::make_shared<PmemKV>(manifest_->PmemKVPath());
-  status_ = State::USING_PMEMKV;
+  manifest_ = new Manifest(pool_dir_, PMEMOBJ_MIN_POOL, create);
+  if (!create && manifest_->IsComboTree()) {
+    // blevel is persistent, alevel and dram parts of blevel are rebuilt
+    blevel_ = std::make_shared<BLevel>(manifest_->BLevelId(), RECOVERY_THREADS);
+    alevel_ = std::make_shared<ALevel>(blevel_, manifest_->ALevelPath(), ALEVEL_EPSILON,
+                                       RECOVERY_THREADS);
+    status_ = State::USING_COMBO_TREE;
+  } else {
+    pmemkv_ = std::make_shared<PmemKV>(manifest_->PmemKVPath());
+    status_ = State::USING_PMEMKV;
+  }
 }
 
 ComboTree::~ComboTree() {
@@ -32,44 +79,66 @@ ComboTree::~ComboTree() {
   }
   pmemkv_.reset();
   alevel_.reset();
+  // kept for reopen
+  if (blevel_)
+    blevel_->KeepFiles();
   blevel_.reset();
+  expand_blevel_.reset();
 }
 
 size_t ComboTree::Size() const {
-  if (status_.load() == State::USING_COMBO_TREE ||
-      status_.load() == State::COMBO_TREE_EXPANDING) {
-    // FIXME: size when expanding?
-    return alevel_->Size();
+  if (status_.load() == State::USING_COMBO_TREE) {
+    return std::atomic_load(&alevel_)->Size();
+  } else if (status_.load() == State::COMBO_TREE_EXPANDING) {
+    std::shared_ptr<BLevel> old_blevel = std::atomic_load(&blevel_);
+    std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+    if (new_blevel == nullptr || new_blevel == old_blevel)
+      return old_blevel->Size();
+    // new blevel counts pairs that are already migrated
+    return old_blevel->Size() - old_blevel->MigratedSize() + new_blevel->Size();
   } else {
     return pmemkv_->Size();
   }
 }
 
 size_t ComboTree::CLevelCount() const {
-  return blevel_->CountCLevel();
+  return std::atomic_load(&blevel_)->CountCLevel();
 }
 
 size_t ComboTree::BLevelEntries() const {
-  return blevel_->Entries();
+  return std::atomic_load(&blevel_)->Entries();
 }
 
 void ComboTree::BLevelCompression() const {
-  blevel_->PrefixCompression();
+  std::atomic_load(&blevel_)->PrefixCompression();
 }
 
 uint64_t ComboTree::Usage() const {
-  return blevel_->Usage();
+  return std::atomic_load(&blevel_)->Usage();
+}
+
+uint64_t ComboTree::LockUsage() const {
+  return std::atomic_load(&blevel_)->LockUsage();
+}
+
+uint64_t ComboTree::FilterUsage() const {
+  return std::atomic_load(&blevel_)->FilterUsage();
+}
+
+uint64_t ComboTree::ReclaimableUsage() const {
+  return std::atomic_load(&blevel_)->ReclaimableUsage();
 }
 
 int64_t ComboTree::CLevelTime() const {
-  return blevel_->CLevelTime();
+  return std::atomic_load(&blevel_)->CLevelTime();
 }
 
-void ComboTree::ChangeToComboTree_() {
+bool ComboTree::ChangeToComboTree_(const std::pair<uint64_t,uint64_t>* pairs,
+                                   size_t count) {
   State tmp = State::USING_PMEMKV;
   // must change status first
   if (!status_.compare_exchange_strong(tmp, State::PMEMKV_TO_COMBO_TREE)) {
-    return;
+    return false;
   }
   permit_delete_.store(false);
   PmemKV::SetWriteUnvalid();
@@ -80,13 +149,19 @@ void ComboTree::ChangeToComboTree_() {
   LOG(Debug::INFO, "start to migrate data from pmemkv to combotree...");
   // std::thread change_thread([&](){
     std::vector<std::pair<uint64_t,uint64_t>> exist_kv;
-    pmemkv_->Scan(0, UINT64_MAX, UINT64_MAX, exist_kv);
+    if (pairs == nullptr) {
+      pmemkv_->Scan(0, UINT64_MAX, UINT64_MAX, exist_kv);
+      pairs = exist_kv.data();
+      count = exist_kv.size();
+    }
 
-    blevel_ = std::make_shared<BLevel>(exist_kv.size());
-    blevel_->Expansion(exist_kv);
+    blevel_ = std::make_shared<BLevel>(count);
+    blevel_->Expansion(pairs, count);
 
     alevel_ = std::make_shared<ALevel>(blevel_);
     // change manifest first
+    alevel_->Persist(manifest_->ALevelPath());
+    manifest_->SetBLevelId(blevel_->Id());
     manifest_->SetIsComboTree(true);
     State s = State::PMEMKV_TO_COMBO_TREE;
     // must change status before wating no ref
@@ -100,8 +175,34 @@ void ComboTree::ChangeToComboTree_() {
     permit_delete_.store(true);
   // });
   // change_thread.detach();
+  return true;
+}
+
+bool ComboTree::BulkLoad(const std::pair<uint64_t,uint64_t>* pairs, size_t count) {
+  if (count == 0 || status_.load() != State::USING_PMEMKV || Size() != 0)
+    return false;
+  return ChangeToComboTree_(pairs, count);
+}
+
+bool ComboTree::BulkLoad(std::vector<std::pair<uint64_t,uint64_t>>& pairs,
+                         int sort_threads) {
+  if (pairs.empty() || status_.load() != State::USING_PMEMKV || Size() != 0)
+    return false;
+  ParallelSort(pairs, sort_threads);
+  // sort is stable, the last one of equal keys is the latest value
+  size_t n = 0;
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    if (n > 0 && pairs[n-1].first == pairs[i].first)
+      pairs[n-1] = pairs[i];
+    else
+      pairs[n++] = pairs[i];
+  }
+  pairs.resize(n);
+  return BulkLoad(pairs.data(), pairs.size());
 }
 
+// rebuild blevel and alevel for current size, which is larger after puts
+// or smaller after deletes
 void ComboTree::ExpandComboTree_() {
   // change status
   State tmp = State::USING_COMBO_TREE;
@@ -110,27 +211,32 @@ void ComboTree::ExpandComboTree_() {
     return;
   }
 
-  std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-  LOG(Debug::INFO, "start to expand combotree. current size is %ld", Size());
-
-  Timer timer;
-  timer.Start();
-
   permit_delete_.store(false);
-  std::shared_ptr<BLevel> old_blevel = blevel_;
-  std::shared_ptr<ALevel> old_alevel = alevel_;
 
-  blevel_ = std::make_shared<BLevel>(old_blevel->Size());
+  // expand in background, writers keep working on keys that are not
+  // being migrated.
+  std::thread expansion_thread([this]() {
+    LOG(Debug::INFO, "start to expand combotree. current size is %ld", Size());
 
-  // std::thread expandion_thread([&,new_pool,old_pool_path,old_alevel,old_blevel]() mutable {
-    blevel_->Expansion(old_blevel.get());
+    Timer timer;
+    timer.Start();
 
-    std::shared_ptr<ALevel> new_alevel = std::make_shared<ALevel>(blevel_);
-    alevel_ = new_alevel;
+    std::shared_ptr<BLevel> old_blevel = std::atomic_load(&blevel_);
+    std::shared_ptr<BLevel> new_blevel =
+        std::make_shared<BLevel>(old_blevel->Size() * ENTRY_SIZE_FACTOR);
 
     expand_min_key_.store(0);
     expand_max_key_.store(0);
+    std::atomic_store(&expand_blevel_, new_blevel);
+
+    new_blevel->ParallelExpansion(old_blevel.get(), EXPANSION_THREADS,
+                                  &expand_min_key_, &expand_max_key_);
+
+    std::shared_ptr<ALevel> new_alevel = std::make_shared<ALevel>(new_blevel);
+    new_alevel->Persist(manifest_->ALevelPath());
+    manifest_->SetBLevelId(new_blevel->Id());
+    std::atomic_store(&alevel_, new_alevel);
+    std::atomic_store(&blevel_, new_blevel);
 
     // change status
     State s = State::COMBO_TREE_EXPANDING;
@@ -139,22 +245,46 @@ void ComboTree::ExpandComboTree_() {
           "can not change state from COMBO_TREE_EXPANDING to USING_COMBO_TREE!");
     }
 
-    old_alevel.reset();
+    // requests still in expanding state go to the new alevel
+    expand_min_key_.store(0);
+    expand_max_key_.store(0);
+
+    // old alevel and blevel are released when the last reader drops them
     old_blevel.reset();
-  // });
-  // expandion_thread.detach();
 
-  expand_time += timer.End();
+    expand_time += timer.End();
+
+    LOG(Debug::INFO, "finish expanding combotree. current size is %ld, current entry count is %ld, expansion time is %lfs", Size(), new_blevel->Entries(), (double)expand_time/1000000.0);
+    permit_delete_.store(true);
+  });
+  expansion_thread.detach();
+}
+
+// low-water mark of deletes, a single entry is never contracted
+bool ComboTree::NeedContract_() const {
+  std::shared_ptr<BLevel> blevel = std::atomic_load(&blevel_);
+  return blevel->Entries() > 1 &&
+         Size() < CONTRACTION_FACTOR * BLEVEL_EXPAND_BUF_KEY * blevel->Entries();
+}
 
-  LOG(Debug::INFO, "finish expanding combotree. current size is %ld, current entry count is %ld, expansion time is %lfs", Size(), blevel_->Entries(), (double)expand_time/1000000.0);
-  permit_delete_.store(true);
+bool ComboTree::Contract() {
+  if (status_.load() != State::USING_COMBO_TREE)
+    return false;
+  std::shared_ptr<BLevel> old_blevel = std::atomic_load(&blevel_);
+  // not smaller after rebuilding
+  if ((Size() + BLEVEL_EXPAND_BUF_KEY - 1) / BLEVEL_EXPAND_BUF_KEY >= old_blevel->Entries())
+    return false;
+  ExpandComboTree_();
+  // another expansion may have started, wait for it as well
+  while (std::atomic_load(&blevel_) == old_blevel || permit_delete_.load() == false)
+    std::this_thread::sleep_for(std::chrono::microseconds(10));
+  return true;
 }
 
 bool ComboTree::Put(uint64_t key, uint64_t value) {
   int wait = 0;
-  int is_expanding = 0;
-  int wait_expanding_finish = 0;
   bool ret;
+  bool migrated;
   while (true) {
     // the order of comparison should not be changed
     if (status_.load() == State::USING_PMEMKV) {
@@ -167,29 +297,30 @@ bool ComboTree::Put(uint64_t key, uint64_t value) {
       wait++;
       continue;
     } else if (status_.load() == State::USING_COMBO_TREE) {
-      ret = alevel_->Put(key, value);
-      if (Size() >= EXPANSION_FACTOR * BLEVEL_EXPAND_BUF_KEY * blevel_->Entries())
+      // hold the levels, expansion may replace and release them meanwhile
+      std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+      ret = alevel->Put(key, value, migrated);
+      // expansion started after we load the status
+      if (migrated)
+        continue;
+      if (Size() >= EXPANSION_FACTOR * BLEVEL_EXPAND_BUF_KEY * alevel->blevel_->Entries())
         ExpandComboTree_();
       ret = true;
       break;
     } else if (status_.load() == State::COMBO_TREE_EXPANDING) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-      continue;
-      assert(0);
-      if (blevel_->Size() >= EXPANSION_FACTOR * BLEVEL_EXPAND_BUF_KEY * blevel_->Entries()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        wait++;
-        wait_expanding_finish++;
-        continue;
-      } else if (key < expand_min_key_.load()) {
-        assert(0);
-        // s = blevel_->Put(key, value) ? Status::OK : Status::ALREADY_EXISTS;
+      if (key < expand_min_key_.load()) {
+        std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+        ret = new_blevel->Put(key, value, 0, new_blevel->Entries() - 1, migrated);
       } else if (key >= expand_max_key_.load()) {
-        ret = alevel_->Put(key, value);
+        std::shared_ptr<ALevel> old_alevel = std::atomic_load(&alevel_);
+        ret = old_alevel->Put(key, value, migrated);
       } else {
-        assert(0);
+        // key is being migrated
         std::this_thread::sleep_for(std::chrono::microseconds(5));
-        is_expanding++;
+        wait++;
+        continue;
+      }
+      if (migrated) {
         wait++;
         continue;
       }
@@ -197,7 +328,7 @@ bool ComboTree::Put(uint64_t key, uint64_t value) {
     }
   }
   if (wait >= 50)
-    LOG(Debug::WARNING, "wait: %d, wait finish: %d, is expanding: %d", wait, wait_expanding_finish, is_expanding);
+    LOG(Debug::WARNING, "wait: %d", wait);
   return ret;
 }
 
@@ -212,18 +343,18 @@ bool ComboTree::Get(uint64_t key, uint64_t& value) const {
       ret = pmemkv_->Get(key, value);
       break;
     } else if (status_.load() == State::USING_COMBO_TREE) {
-      ret = alevel_->Get(key, value);
+      std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+      ret = alevel->Get(key, value);
       break;
     } else if (status_.load() == State::COMBO_TREE_EXPANDING) {
+      // migrated entries are left untouched in old blevel, so keys not yet
+      // in new blevel can always be read from old one.
       if (key < expand_min_key_.load()) {
-        assert(0);
-        // ret = blevel_->Get(key, value);
-      } else if (key >= expand_max_key_.load()) {
-        ret = alevel_->Get(key, value);
+        std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+        ret = new_blevel->Get(key, value, 0, new_blevel->Entries() - 1);
       } else {
-        assert(0);
-        std::this_thread::sleep_for(std::chrono::microseconds(5));
-        continue;
+        std::shared_ptr<ALevel> old_alevel = std::atomic_load(&alevel_);
+        ret = old_alevel->Get(key, value);
       }
       break;
     }
@@ -233,6 +364,7 @@ bool ComboTree::Get(uint64_t key, uint64_t& value) const {
 
 bool ComboTree::Delete(uint64_t key) {
   bool ret;
+  bool migrated;
   while (true) {
     // the order of comparison should not be changed
     if (status_.load() == State::USING_PMEMKV) {
@@ -242,128 +374,458 @@ bool ComboTree::Delete(uint64_t key) {
       std::this_thread::sleep_for(std::chrono::microseconds(5));
       continue;
     } else if (status_.load() == State::USING_COMBO_TREE) {
-      ret = alevel_->Delete(key, nullptr);
+      std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+      ret = alevel->Delete(key, nullptr, migrated);
+      if (migrated)
+        continue;
+      if (ret && NeedContract_())
+        ExpandComboTree_();
       break;
     } else if (status_.load() == State::COMBO_TREE_EXPANDING) {
       if (key < expand_min_key_.load()) {
-        assert(0);
-        // s = blevel_->Delete(key) ? Status::OK : Status::DOES_NOT_EXIST;
+        std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+        ret = new_blevel->Delete(key, nullptr, 0, new_blevel->Entries() - 1, migrated);
       } else if (key >= expand_max_key_.load()) {
-        ret = alevel_->Delete(key, nullptr);
+        std::shared_ptr<ALevel> old_alevel = std::atomic_load(&alevel_);
+        ret = old_alevel->Delete(key, nullptr, migrated);
       } else {
         std::this_thread::sleep_for(std::chrono::microseconds(5));
         continue;
       }
+      if (migrated)
+        continue;
       break;
     }
   }
   return ret;
 }
 
-/************************ ComboTree::IterImpl ************************/
-class ComboTree::IterImpl {
- public:
-  IterImpl(const ComboTree* tree)
-    : tree_(tree), biter_(nullptr)
+template <typename Out>
+size_t ComboTree::Scan_(uint64_t min_key, uint64_t max_key, size_t max_size,
+                        Out&& out) const {
+  if (min_key > max_key || max_size == 0)
+    return 0;
+  State status = status_.load();
+  if (status == State::USING_PMEMKV || status == State::PMEMKV_TO_COMBO_TREE) {
+    std::vector<std::pair<uint64_t,uint64_t>> kv;
+    pmemkv_->Scan(min_key, max_key, max_size, kv);
+    for (auto& pair : kv)
+      out(pair.first, pair.second);
+    return kv.size();
+  } else if (status == State::USING_COMBO_TREE) {
+    std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+    uint64_t begin, end;
+    alevel->GetBLevelRange_(min_key, begin, end);
+    return alevel->blevel_->Scan(min_key, max_key, max_size, begin, end, out);
+  } else {
+    // same split as Iter, keys less than split key are in new blevel
+    uint64_t split_key = expand_min_key_.load();
+    std::shared_ptr<BLevel> old_blevel = std::atomic_load(&blevel_);
+    std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+    size_t count = 0;
+    if (split_key == UINT64_MAX) {
+      old_blevel = new_blevel;
+      split_key = 0;
+    } else if (split_key != 0 && new_blevel != nullptr && new_blevel != old_blevel &&
+               min_key < split_key) {
+      count = new_blevel->Scan(min_key, std::min(max_key, split_key - 1), max_size,
+                               0, new_blevel->Entries() - 1, out);
+    } else {
+      split_key = 0;
+    }
+    if (count < max_size && max_key >= split_key)
+      count += old_blevel->Scan(std::max(min_key, split_key), max_key, max_size - count,
+                                0, old_blevel->Entries() - 1, out);
+    return count;
+  }
+}
+
+template <typename Out>
+size_t ComboTree::ReverseScan_(uint64_t min_key, uint64_t max_key, size_t max_size,
+                               Out&& out) const {
+  if (min_key > max_key || max_size == 0)
+    return 0;
+  State status = status_.load();
+  if (status == State::USING_PMEMKV || status == State::PMEMKV_TO_COMBO_TREE) {
+    // pmemkv holds few keys, scan the whole range forward
+    std::vector<std::pair<uint64_t,uint64_t>> kv;
+    pmemkv_->Scan(min_key, max_key, UINT64_MAX, kv);
+    size_t count = std::min(max_size, kv.size());
+    for (size_t i = 0; i < count; ++i)
+      out(kv[kv.size() - 1 - i].first, kv[kv.size() - 1 - i].second);
+    return count;
+  } else if (status == State::USING_COMBO_TREE) {
+    std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+    uint64_t begin, end;
+    alevel->GetBLevelRange_(max_key, begin, end);
+    return alevel->blevel_->ReverseScan(min_key, max_key, max_size, begin, end, out);
+  } else {
+    // same split as Scan_(), keys larger or equal to split key come first
+    uint64_t split_key = expand_min_key_.load();
+    std::shared_ptr<BLevel> old_blevel = std::atomic_load(&blevel_);
+    std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+    if (split_key == UINT64_MAX)
+      return new_blevel->ReverseScan(min_key, max_key, max_size,
+                                     0, new_blevel->Entries() - 1, out);
+    size_t count = 0;
+    bool split = split_key != 0 && new_blevel != nullptr && new_blevel != old_blevel;
+    if (!split || max_key >= split_key)
+      count = old_blevel->ReverseScan(split ? std::max(min_key, split_key) : min_key, max_key,
+                                      max_size, 0, old_blevel->Entries() - 1, out);
+    if (split && count < max_size && min_key < split_key)
+      count += new_blevel->ReverseScan(min_key, std::min(max_key, split_key - 1),
+                                       max_size - count, 0, new_blevel->Entries() - 1, out);
+    return count;
+  }
+}
+
+size_t ComboTree::Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                       std::vector<std::pair<uint64_t, uint64_t>>& results) {
+  return Scan_(min_key, max_key, max_size, [&](uint64_t key, uint64_t value) {
+    results.emplace_back(key, value);
+  });
+}
+
+size_t ComboTree::Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                       Pair* results) {
+  return Scan_(min_key, max_key, max_size, [&](uint64_t key, uint64_t value) {
+    results->key = key;
+    results->value = value;
+    results++;
+  });
+}
+
+size_t ComboTree::Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                       uint64_t* results) {
+  return Scan_(min_key, max_key, max_size, [&](uint64_t key, uint64_t value) {
+    *results++ = value;
+  });
+}
+
+size_t ComboTree::ParallelScan(uint64_t min_key, uint64_t max_key, int chunks,
+    int thread_num, const std::function<void(int, uint64_t, uint64_t)>& chunk_fn) const {
+  if (min_key > max_key || chunks <= 0)
+    return 0;
+  auto out_fn = [&](int chunk) {
+    return [&chunk_fn, chunk](uint64_t key, uint64_t value) { chunk_fn(chunk, key, value); };
+  };
+  std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+  if (status_.load() != State::USING_COMBO_TREE || alevel == nullptr ||
+      chunks == 1 || thread_num <= 1)
+    return Scan_(min_key, max_key, SIZE_MAX, out_fn(0));
+
+  // alevel may be replaced by expansion, keep using the snapshot
+  const BLevel* blevel = alevel->blevel_.get();
+  uint64_t begin, end;
+  alevel->GetBLevelRange_(min_key, begin, end);
+  uint64_t first = blevel->FindEntry(min_key, begin, end);
+  alevel->GetBLevelRange_(max_key, begin, end);
+  uint64_t last = blevel->FindEntry(max_key, begin, end);
+  uint64_t nr_entries = last - first + 1;
+  chunks = std::min<uint64_t>(chunks, nr_entries);
+
+  // entries [first + c * nr_entries / chunks, first + (c+1) * nr_entries / chunks)
+  // are scanned by chunk c, one entry at a time
+  std::atomic<size_t> count(0);
   {
-    if (tree_->blevel_ != nullptr) {
-      biter_ = new BLevel::Iter(tree_->blevel_.get());
+    ThreadPool pool(std::min(thread_num, chunks));
+    for (int c = 0; c < chunks; ++c) {
+      pool.Submit([&, c]() {
+        uint64_t chunk_begin = first + c * nr_entries / chunks;
+        uint64_t chunk_end = first + (c + 1) * nr_entries / chunks;
+        size_t chunk_count = 0;
+        auto out = out_fn(c);
+        for (uint64_t idx = chunk_begin; idx < chunk_end; ++idx) {
+          uint64_t lo = idx == first ? min_key : blevel->EntryKey(idx);
+          uint64_t hi = idx == last ? max_key : blevel->EntryKey(idx + 1) - 1;
+          chunk_count += blevel->Scan(lo, hi, SIZE_MAX, idx, idx, out);
+        }
+        count += chunk_count;
+      });
+    }
+  }
+  return count.load();
+}
+
+size_t ComboTree::ParallelScan(uint64_t min_key, uint64_t max_key, int chunks,
+    int thread_num, std::vector<std::vector<std::pair<uint64_t, uint64_t>>>& results) const {
+  results.resize(std::max(chunks, 0));
+  return ParallelScan(min_key, max_key, chunks, thread_num,
+      [&](int chunk, uint64_t key, uint64_t value) {
+        results[chunk].emplace_back(key, value);
+      });
+}
+
+template <typename BLevelFn, typename PairFn>
+void ComboTree::VisitRange_(uint64_t min_key, uint64_t max_key, BLevelFn blevel_fn,
+                            PairFn pair_fn) const {
+  if (min_key > max_key)
+    return;
+  State status = status_.load();
+  if (status == State::USING_PMEMKV || status == State::PMEMKV_TO_COMBO_TREE) {
+    std::vector<std::pair<uint64_t,uint64_t>> kv;
+    pmemkv_->Scan(min_key, max_key, UINT64_MAX, kv);
+    for (auto& pair : kv)
+      pair_fn(pair.first, pair.second);
+  } else if (status == State::USING_COMBO_TREE) {
+    std::shared_ptr<ALevel> alevel = std::atomic_load(&alevel_);
+    uint64_t begin, end;
+    alevel->GetBLevelRange_(min_key, begin, end);
+    blevel_fn(*alevel->blevel_, min_key, max_key, begin, end);
+  } else {
+    // same split as Scan_()
+    uint64_t split_key = expand_min_key_.load();
+    std::shared_ptr<BLevel> old_blevel = std::atomic_load(&blevel_);
+    std::shared_ptr<BLevel> new_blevel = std::atomic_load(&expand_blevel_);
+    if (split_key == UINT64_MAX) {
+      old_blevel = new_blevel;
+      split_key = 0;
+    } else if (split_key != 0 && new_blevel != nullptr && new_blevel != old_blevel &&
+               min_key < split_key) {
+      blevel_fn(*new_blevel, min_key, std::min(max_key, split_key - 1),
+                0, new_blevel->Entries() - 1);
     } else {
-      assert(0);
-      biter_ = nullptr;
+      split_key = 0;
     }
+    if (max_key >= split_key)
+      blevel_fn(*old_blevel, std::max(min_key, split_key), max_key,
+                0, old_blevel->Entries() - 1);
   }
+}
 
-  IterImpl(const ComboTree* tree, uint64_t start_key)
-    : tree_(tree), biter_(nullptr)
+RangeStats ComboTree::AggregateRange(uint64_t min_key, uint64_t max_key) const {
+  ValueStats stats;
+  VisitRange_(min_key, max_key,
+      [&](const BLevel& blevel, uint64_t lo, uint64_t hi, uint64_t begin, uint64_t end) {
+        blevel.Aggregate(lo, hi, begin, end, stats);
+      },
+      [&](uint64_t, uint64_t value) {
+        stats.count++;
+        stats.sum += value;
+        stats.min = std::min(stats.min, value);
+        stats.max = std::max(stats.max, value);
+      });
+  return RangeStats{stats.count, stats.sum, stats.min, stats.max};
+}
+
+size_t ComboTree::CountRange(uint64_t min_key, uint64_t max_key) const {
+  return AggregateRange(min_key, max_key).count;
+}
+
+uint64_t ComboTree::SumRange(uint64_t min_key, uint64_t max_key) const {
+  return AggregateRange(min_key, max_key).sum;
+}
+
+void ComboTree::ReduceRange(uint64_t min_key, uint64_t max_key,
+    const std::function<void(uint64_t, uint64_t)>& reducer) const {
+  VisitRange_(min_key, max_key,
+      [&](const BLevel& blevel, uint64_t lo, uint64_t hi, uint64_t begin, uint64_t end) {
+        blevel.Reduce(lo, hi, begin, end, reducer);
+      },
+      reducer);
+}
+
+namespace {
+
+struct IterSnapshot {
+  // keys less than split_key are read from first, the others from second
+  std::shared_ptr<BLevel> first;
+  std::shared_ptr<BLevel> second;
+  uint64_t split_key;
+  uint64_t start_key;
+  // blevel range of start_key in second
+  uint64_t begin;
+  uint64_t end;
+};
+
+template <typename BLevelIter>
+class SplitIter {
+ public:
+  SplitIter(const IterSnapshot& snapshot)
+    : snapshot_(snapshot), iter_(nullptr), in_first_(false)
   {
-    if (tree_->blevel_ != nullptr) {
-      uint64_t begin, end;
-      tree_->alevel_->GetBLevelRange_(start_key, begin, end);
-      biter_ = new BLevel::Iter(tree_->blevel_.get(), start_key, begin, end);
+    if (snapshot_.first != nullptr && snapshot_.start_key < snapshot_.split_key) {
+      in_first_ = true;
+      iter_ = new BLevelIter(snapshot_.first.get(), snapshot_.start_key, 0,
+                             snapshot_.first->Entries() - 1, snapshot_.split_key);
+      SkipOutOfRange_();
     } else {
-      assert(0);
-      biter_ = nullptr;
+      OpenSecond_();
     }
   }
 
-  ~IterImpl() {
-    if (biter_)
-      delete biter_;
+  ~SplitIter() {
+    if (iter_)
+      delete iter_;
   }
 
   ALWAYS_INLINE uint64_t key() const {
-    return biter_->key();
+    return iter_->key();
   }
 
   ALWAYS_INLINE uint64_t value() const {
-    return biter_->value();
+    return iter_->value();
   }
 
   ALWAYS_INLINE bool next() {
-    return biter_->next();
+    iter_->next();
+    SkipOutOfRange_();
+    return !end();
   }
 
   ALWAYS_INLINE bool end() const {
-    return biter_ == nullptr || biter_->end();
+    return iter_ == nullptr || iter_->end();
   }
 
  private:
-  const ComboTree* tree_;
-  BLevel::Iter* biter_;
+  IterSnapshot snapshot_;
+  BLevelIter* iter_;
+  bool in_first_;
+
+  void OpenSecond_() {
+    in_first_ = false;
+    if (iter_)
+      delete iter_;
+    uint64_t start_key = snapshot_.first == nullptr ? snapshot_.start_key :
+                         std::max(snapshot_.start_key, snapshot_.split_key);
+    iter_ = new BLevelIter(snapshot_.second.get(), start_key,
+                           snapshot_.begin, snapshot_.end);
+    SkipOutOfRange_();
+  }
+
+  // unsorted iter and the last entry of new blevel may return keys out of
+  // the range of current blevel.
+  void SkipOutOfRange_() {
+    while (true) {
+      if (in_first_) {
+        if (iter_->end()) {
+          OpenSecond_();
+          return;
+        }
+        if (iter_->key() < snapshot_.split_key)
+          return;
+      } else {
+        if (snapshot_.first == nullptr || iter_->end() ||
+            iter_->key() >= snapshot_.split_key)
+          return;
+      }
+      iter_->next();
+    }
+  }
 };
 
-/********************* ComboTree::NoSortIterImpl *********************/
-class ComboTree::NoSortIterImpl {
+} // anonymous namespace
+
+/************************ ComboTree::IterImpl ************************/
+class ComboTree::IterImpl : public SplitIter<BLevel::Iter> {
  public:
-  NoSortIterImpl(const ComboTree* tree)
-    : tree_(tree), biter_(nullptr)
-  {
-    if (tree_->blevel_ != nullptr) {
-      biter_ = new BLevel::NoSortIter(tree_->blevel_.get());
+  IterImpl(const ComboTree* tree) : IterImpl(tree, 0) {}
+
+  IterImpl(const ComboTree* tree, uint64_t start_key)
+    : SplitIter(Snapshot(tree, start_key)) {}
+
+  // pick the blevels to read. during expansion, keys less than
+  // expand_min_key_ are in new blevel and the others in old blevel.
+  static IterSnapshot Snapshot(const ComboTree* tree, uint64_t start_key) {
+    IterSnapshot snapshot;
+    snapshot.first = nullptr;
+    snapshot.split_key = 0;
+    snapshot.start_key = start_key;
+    if (tree->status_.load() == State::COMBO_TREE_EXPANDING) {
+      uint64_t split_key = tree->expand_min_key_.load();
+      std::shared_ptr<BLevel> old_blevel = std::atomic_load(&tree->blevel_);
+      std::shared_ptr<BLevel> new_blevel = std::atomic_load(&tree->expand_blevel_);
+      if (split_key == UINT64_MAX) {
+        snapshot.second = new_blevel;
+      } else {
+        snapshot.second = old_blevel;
+        if (split_key != 0 && new_blevel != nullptr && new_blevel != old_blevel) {
+          snapshot.first = new_blevel;
+          snapshot.split_key = split_key;
+        }
+      }
+      snapshot.begin = 0;
+      snapshot.end = snapshot.second->Entries() - 1;
     } else {
-      assert(0);
-      biter_ = nullptr;
+      assert(tree->alevel_ != nullptr);
+      std::shared_ptr<ALevel> alevel = std::atomic_load(&tree->alevel_);
+      snapshot.second = alevel->blevel_;
+      alevel->GetBLevelRange_(start_key, snapshot.begin, snapshot.end);
     }
+    return snapshot;
   }
+};
+
+/********************* ComboTree::NoSortIterImpl *********************/
+class ComboTree::NoSortIterImpl : public SplitIter<BLevel::NoSortIter> {
+ public:
+  NoSortIterImpl(const ComboTree* tree) : NoSortIterImpl(tree, 0) {}
 
   NoSortIterImpl(const ComboTree* tree, uint64_t start_key)
-    : tree_(tree), biter_(nullptr)
+    : SplitIter(IterImpl::Snapshot(tree, start_key)) {}
+};
+
+/********************* ComboTree::ReverseIterImpl ********************/
+// pairs are loaded in batches by ReverseScan_(), each batch descends from
+// alevel again, so the iterator holds no lock between batches.
+class ComboTree::ReverseIterImpl {
+ public:
+  ReverseIterImpl(const ComboTree* tree, uint64_t start_key)
+    : tree_(tree)
   {
-    if (tree_->blevel_ != nullptr) {
-      uint64_t begin, end;
-      tree_->alevel_->GetBLevelRange_(start_key, begin, end);
-      biter_ = new BLevel::NoSortIter(tree_->blevel_.get(), start_key, begin, end);
-    } else {
-      assert(0);
-      biter_ = nullptr;
-    }
+    SeekForPrev(start_key);
   }
 
-  ~NoSortIterImpl() {
-    if (biter_)
-      delete biter_;
+  void SeekForPrev(uint64_t key) {
+    batch_size_ = MIN_BATCH;
+    next_key_ = key;
+    done_ = false;
+    Load_();
   }
 
   ALWAYS_INLINE uint64_t key() const {
-    return biter_->key();
+    return pairs_[pos_].first;
   }
 
   ALWAYS_INLINE uint64_t value() const {
-    return biter_->value();
+    return pairs_[pos_].second;
   }
 
   ALWAYS_INLINE bool next() {
-    return biter_->next();
+    if (++pos_ >= pairs_.size())
+      Load_();
+    return !end();
   }
 
   ALWAYS_INLINE bool end() const {
-    return biter_ == nullptr || biter_->end();
+    return pos_ >= pairs_.size();
   }
 
  private:
+  // batch grows for long scans, short scans only read a few leaves
+  static constexpr size_t MIN_BATCH = 16;
+  static constexpr size_t MAX_BATCH = 1024;
+
   const ComboTree* tree_;
-  BLevel::NoSortIter* biter_;
+  std::vector<std::pair<uint64_t,uint64_t>> pairs_;
+  size_t pos_;
+  size_t batch_size_;
+  uint64_t next_key_;  // next batch starts from this key
+  bool done_;
+
+  void Load_() {
+    pairs_.clear();
+    pos_ = 0;
+    if (done_)
+      return;
+    size_t count = tree_->ReverseScan_(0, next_key_, batch_size_,
+        [&](uint64_t key, uint64_t value) { pairs_.emplace_back(key, value); });
+    if (count < batch_size_ || pairs_.back().first == 0)
+      done_ = true;
+    else
+      next_key_ = pairs_.back().first - 1;
+    batch_size_ = std::min(batch_size_ * 2, MAX_BATCH);
+  }
 };
 
 
@@ -371,6 +833,7 @@ class ComboTree::NoSortIterImpl {
 ComboTree::Iter::Iter(const ComboTree* tree) : pimpl_(new IterImpl(tree)) {}
 ComboTree::Iter::Iter(const ComboTree* tree, uint64_t start_key)
   : pimpl_(new IterImpl(tree, start_key)) {}
+ComboTree::Iter::~Iter()                { delete pimpl_; }
 uint64_t ComboTree::Iter::key() const   { return pimpl_->key(); }
 uint64_t ComboTree::Iter::value() const { return pimpl_->value(); }
 bool ComboTree::Iter::next()            { return pimpl_->next(); }
@@ -381,12 +844,26 @@ bool ComboTree::Iter::end() const       { return pimpl_->end(); }
 ComboTree::NoSortIter::NoSortIter(const ComboTree* tree) : pimpl_(new NoSortIterImpl(tree)) {}
 ComboTree::NoSortIter::NoSortIter(const ComboTree* tree, uint64_t start_key)
   : pimpl_(new NoSortIterImpl(tree, start_key)) {}
+ComboTree::NoSortIter::~NoSortIter()          { delete pimpl_; }
 uint64_t ComboTree::NoSortIter::key() const   { return pimpl_->key(); }
 uint64_t ComboTree::NoSortIter::value() const { return pimpl_->value(); }
 bool ComboTree::NoSortIter::next()            { return pimpl_->next(); }
 bool ComboTree::NoSortIter::end() const       { return pimpl_->end(); }
 
 
+/********************* ComboTree::ReverseIter ********************/
+ComboTree::ReverseIter::ReverseIter(const ComboTree* tree)
+  : pimpl_(new ReverseIterImpl(tree, UINT64_MAX)) {}
+ComboTree::ReverseIter::ReverseIter(const ComboTree* tree, uint64_t start_key)
+  : pimpl_(new ReverseIterImpl(tree, start_key)) {}
+ComboTree::ReverseIter::~ReverseIter()                 { delete pimpl_; }
+void ComboTree::ReverseIter::SeekForPrev(uint64_t key) { pimpl_->SeekForPrev(key); }
+uint64_t ComboTree::ReverseIter::key() const           { return pimpl_->key(); }
+uint64_t ComboTree::ReverseIter::value() const         { return pimpl_->value(); }
+bool ComboTree::ReverseIter::next()                    { return pimpl_->next(); }
+bool ComboTree::ReverseIter::end() const               { return pimpl_->end(); }
+
+
 namespace {
 
 // https://stackoverflow.com/a/18101042/7640227
@@ -5,11 +5,336 @@
 #include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <atomic>
 #include "combotree_config.h"
 #include "pmem.h"
 
 namespace combotree {
 
+#if !defined(BUF_SORT) && (defined(__AVX512BW__) || defined(__AVX2__))
+#define KVBUFFER_SIMD
+#endif
+
+// constant tables of KVBuffer, indexed by prefix_bytes or suffix_bytes
+struct KVBufferTable {
+  // byte i is i % suffix_bytes, used to repeat the target suffix over
+  // the whole key area. vpshufb works inside 16-byte lanes, so the target
+  // is broadcasted to every lane first.
+  alignas(64) uint8_t suffix_pattern[9][64];
+  // bit i * suffix_bytes is set, the first byte of every key
+  uint64_t key_start[9];
+  uint64_t prefix_mask[9];
+  uint64_t suffix_mask[9];
+
+  constexpr KVBufferTable()
+      : suffix_pattern(), key_start(), prefix_mask(), suffix_mask() {
+    for (int bytes = 1; bytes <= 8; ++bytes) {
+      for (int i = 0; i < 64; ++i)
+        suffix_pattern[bytes][i] = i % bytes;
+      for (int i = 0; i < 64; i += bytes)
+        key_start[bytes] |= 1UL << i;
+      prefix_mask[bytes] = ~0UL << ((8 - bytes) * 8);
+      suffix_mask[bytes] = ~0UL >> ((8 - bytes) * 8);
+    }
+  }
+};
+
+inline constexpr KVBufferTable kvbuffer_table;
+
+#if defined(BUF_SORT) && defined(BUF_FINGERPRINT)
+#error "BUF_FINGERPRINT works with unsorted buffer only"
+#endif
+
+// 4-bit fingerprints of the keys of a KVBuffer, nibble i for key i. kept
+// out of the buffer (clevel node padding), 7 bytes hold 14 keys, more than
+// a leaf buffer can have. only used when BUF_FINGERPRINT is defined.
+struct Fingerprints {
+  static const int MAX_KEYS = 14;
+
+  uint8_t fp[7];
+
+  ALWAYS_INLINE static uint64_t Hash(uint64_t suffix) {
+    return (suffix * 0x9E3779B97F4A7C15UL) >> 60;
+  }
+
+  ALWAYS_INLINE uint64_t Get(int idx) const {
+    return (fp[idx / 2] >> (idx % 2 * 4)) & 0xF;
+  }
+
+  ALWAYS_INLINE void Set(int idx, uint64_t hash) {
+    assert(idx < MAX_KEYS);
+    int shift = idx % 2 * 4;
+    fp[idx / 2] = (fp[idx / 2] & ~(0xF << shift)) | (hash << shift);
+  }
+
+  // compare all fingerprints at once in a word, bit 4 * i + 3 is set if
+  // fingerprint of key i equals hash.
+  ALWAYS_INLINE uint64_t Match(uint64_t hash, int entries) const {
+    const uint64_t low_bits = 0x7777777777777777UL;
+    // two overlapped 4-byte loads, a 7-byte memcpy goes through stack
+    uint32_t low, high;
+    memcpy(&low, fp, 4);
+    memcpy(&high, fp + 3, 4);
+    uint64_t fps = low | (uint64_t)high << 24;
+    uint64_t diff = fps ^ (hash * 0x1111111111111111UL);
+    // high bit of a nibble is set if the nibble is zero
+    uint64_t zero = ~(((diff & low_bits) + low_bits) | diff | low_bits);
+    return zero & ((1UL << (entries * 4)) - 1);
+  }
+};
+
+static_assert(sizeof(Fingerprints) == 7, "sizeof(Fingerprints) != 7");
+
+// count, sum, min and max of values, filled by aggregation scans. sum
+// wraps around on overflow.
+struct ValueStats {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+};
+
+// add values[i] whose bit i of mask is set to stats, n <= 16
+ALWAYS_INLINE void ReduceValues(const uint64_t* values, int n, uint32_t mask,
+                                ValueStats& stats) {
+  stats.count += __builtin_popcount(mask);
+#if defined(__AVX512F__)
+  __m512i sum = _mm512_setzero_si512();
+  __m512i min = _mm512_set1_epi64(-1);
+  __m512i max = _mm512_setzero_si512();
+  for (int i = 0; i < n; i += 8) {
+    __mmask8 k = mask >> i;
+    __m512i v = _mm512_maskz_loadu_epi64(k, values + i);
+    sum = _mm512_add_epi64(sum, v);
+    min = _mm512_mask_min_epu64(min, k, min, v);
+    max = _mm512_mask_max_epu64(max, k, max, v);
+  }
+  // not _mm512_reduce_*(), gcc warns they read uninitialized vectors
+  uint64_t lanes[3][8];
+  _mm512_storeu_si512(lanes[0], sum);
+  _mm512_storeu_si512(lanes[1], min);
+  _mm512_storeu_si512(lanes[2], max);
+  for (int i = 0; i < 8; ++i) {
+    stats.sum += lanes[0][i];
+    stats.min = std::min(stats.min, lanes[1][i]);
+    stats.max = std::max(stats.max, lanes[2][i]);
+  }
+#elif defined(__AVX2__)
+  // flip the sign bit for unsigned compare
+  const __m256i sign = _mm256_set1_epi64x(1UL << 63);
+  const __m256i lane_bit = _mm256_setr_epi64x(1, 2, 4, 8);
+  __m256i sum = _mm256_setzero_si256();
+  __m256i min = _mm256_set1_epi64x(-1);
+  __m256i max = _mm256_setzero_si256();
+  for (int i = 0; i < n; i += 4) {
+    __m256i k = _mm256_cmpeq_epi64(
+        _mm256_and_si256(_mm256_set1_epi64x(mask >> i), lane_bit), lane_bit);
+    __m256i v = _mm256_maskload_epi64((const long long*)(values + i), k);
+    __m256i signed_v = _mm256_xor_si256(v, sign);
+    sum = _mm256_add_epi64(sum, v);
+    __m256i lt = _mm256_and_si256(k,
+        _mm256_cmpgt_epi64(_mm256_xor_si256(min, sign), signed_v));
+    min = _mm256_blendv_epi8(min, v, lt);
+    __m256i gt = _mm256_cmpgt_epi64(signed_v, _mm256_xor_si256(max, sign));
+    max = _mm256_blendv_epi8(max, v, gt);
+  }
+  uint64_t lanes[3][4];
+  _mm256_storeu_si256((__m256i*)lanes[0], sum);
+  _mm256_storeu_si256((__m256i*)lanes[1], min);
+  _mm256_storeu_si256((__m256i*)lanes[2], max);
+  for (int i = 0; i < 4; ++i) {
+    stats.sum += lanes[0][i];
+    stats.min = std::min(stats.min, lanes[1][i]);
+    stats.max = std::max(stats.max, lanes[2][i]);
+  }
+#else
+  for (int i = 0; i < n; ++i) {
+    if (mask & (1U << i)) {
+      stats.sum += values[i];
+      stats.min = std::min(stats.min, values[i]);
+      stats.max = std::max(stats.max, values[i]);
+    }
+  }
+#endif
+}
+
+// slots of keys[0, n) in key order with std::sort, n <= 16
+ALWAYS_INLINE void ScalarSortSlots(const uint64_t* keys, int n, int* sorted_index) {
+  for (int i = 0; i < n; ++i)
+    sorted_index[i] = i;
+  std::sort(&sorted_index[0], &sorted_index[n],
+    [keys](int a, int b) { return keys[a] < keys[b]; });
+}
+
+// lanes [base, base+lanes) that keep the larger key in step (k, j) of
+// bitonic sort. lane i is compared with lane i ^ j and sorts ascending
+// if i & k == 0.
+constexpr uint32_t BitonicMaxLanes(int base, int lanes, int k, int j) {
+  uint32_t mask = 0;
+  for (int l = 0; l < lanes; ++l)
+    if ((((base + l) & j) != 0) != (((base + l) & k) != 0))
+      mask |= 1U << l;
+  return mask;
+}
+
+#if defined(__AVX512F__)
+// keys and slots in R registers of 8 lanes
+template <int R, int k, int j>
+ALWAYS_INLINE void BitonicStep(__m512i (&key)[R], __m512i (&slot)[R]) {
+  if constexpr (j >= 8) {
+    // only the last merge of 16 keys compares two registers
+    static_assert(R == 2 && k == 16, "unexpected bitonic step");
+    __mmask8 swap = _mm512_cmplt_epu64_mask(key[1], key[0]);
+    __m512i k0 = _mm512_mask_blend_epi64(swap, key[0], key[1]);
+    __m512i s0 = _mm512_mask_blend_epi64(swap, slot[0], slot[1]);
+    key[1] = _mm512_mask_blend_epi64(swap, key[1], key[0]);
+    slot[1] = _mm512_mask_blend_epi64(swap, slot[1], slot[0]);
+    key[0] = k0;
+    slot[0] = s0;
+  } else {
+    const __m512i perm = _mm512_set_epi64(7 ^ j, 6 ^ j, 5 ^ j, 4 ^ j,
+                                          3 ^ j, 2 ^ j, 1 ^ j, 0 ^ j);
+    for (int r = 0; r < R; ++r) {
+      const __mmask8 max_lanes = BitonicMaxLanes(r * 8, 8, k, j);
+      // maskz form, gcc warns _mm512_permutexvar_epi64() is uninitialized
+      __m512i pkey = _mm512_maskz_permutexvar_epi64(0xff, perm, key[r]);
+      __m512i pslot = _mm512_maskz_permutexvar_epi64(0xff, perm, slot[r]);
+      __mmask8 take = (_mm512_cmplt_epu64_mask(pkey, key[r]) & ~max_lanes) |
+                      (_mm512_cmpgt_epu64_mask(pkey, key[r]) & max_lanes);
+      key[r] = _mm512_mask_blend_epi64(take, key[r], pkey);
+      slot[r] = _mm512_mask_blend_epi64(take, slot[r], pslot);
+    }
+  }
+}
+
+template <int R>
+ALWAYS_INLINE void SIMDSortSlots(const uint64_t* keys, int n, int64_t* slots) {
+  __m512i key[R], slot[R];
+  for (int r = 0; r < R; ++r) {
+    int cnt = std::min(std::max(n - r * 8, 0), 8);
+    key[r] = _mm512_mask_loadu_epi64(_mm512_set1_epi64(-1), (1U << cnt) - 1, keys + r * 8);
+    slot[r] = _mm512_add_epi64(_mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0),
+                               _mm512_set1_epi64(r * 8));
+  }
+  BitonicStep<R, 2, 1>(key, slot);
+  BitonicStep<R, 4, 2>(key, slot);
+  BitonicStep<R, 4, 1>(key, slot);
+  BitonicStep<R, 8, 4>(key, slot);
+  BitonicStep<R, 8, 2>(key, slot);
+  BitonicStep<R, 8, 1>(key, slot);
+  if constexpr (R == 2) {
+    BitonicStep<R, 16, 8>(key, slot);
+    BitonicStep<R, 16, 4>(key, slot);
+    BitonicStep<R, 16, 2>(key, slot);
+    BitonicStep<R, 16, 1>(key, slot);
+  }
+  for (int r = 0; r < R; ++r)
+    _mm512_storeu_si512(slots + r * 8, slot[r]);
+}
+#elif defined(__AVX2__)
+// keys and slots in R registers of 4 lanes. keys have the sign bit
+// flipped for unsigned compare.
+template <int R, int k, int j>
+ALWAYS_INLINE void BitonicStep(__m256i (&key)[R], __m256i (&slot)[R]) {
+  if constexpr (j >= 4) {
+    for (int r = 0; r < R; ++r) {
+      int p = r ^ (j / 4);
+      if (p < r)
+        continue;
+      // r keeps the smaller keys if ascending
+      __m256i swap = ((r * 4) & k) == 0 ? _mm256_cmpgt_epi64(key[r], key[p])
+                                        : _mm256_cmpgt_epi64(key[p], key[r]);
+      __m256i kr = _mm256_blendv_epi8(key[r], key[p], swap);
+      __m256i sr = _mm256_blendv_epi8(slot[r], slot[p], swap);
+      key[p] = _mm256_blendv_epi8(key[p], key[r], swap);
+      slot[p] = _mm256_blendv_epi8(slot[p], slot[r], swap);
+      key[r] = kr;
+      slot[r] = sr;
+    }
+  } else {
+    const int perm = j == 1 ? _MM_SHUFFLE(2, 3, 0, 1) : _MM_SHUFFLE(1, 0, 3, 2);
+    for (int r = 0; r < R; ++r) {
+      const uint32_t max_lanes = BitonicMaxLanes(r * 4, 4, k, j);
+      const __m256i max_vec = _mm256_setr_epi64x(
+          -(int64_t)(max_lanes & 1), -(int64_t)((max_lanes >> 1) & 1),
+          -(int64_t)((max_lanes >> 2) & 1), -(int64_t)((max_lanes >> 3) & 1));
+      __m256i pkey = _mm256_permute4x64_epi64(key[r], perm);
+      __m256i pslot = _mm256_permute4x64_epi64(slot[r], perm);
+      __m256i take = _mm256_blendv_epi8(_mm256_cmpgt_epi64(key[r], pkey),
+                                        _mm256_cmpgt_epi64(pkey, key[r]), max_vec);
+      key[r] = _mm256_blendv_epi8(key[r], pkey, take);
+      slot[r] = _mm256_blendv_epi8(slot[r], pslot, take);
+    }
+  }
+}
+
+template <int R>
+ALWAYS_INLINE void SIMDSortSlots(const uint64_t* keys, int n, int64_t* slots) {
+  uint64_t padded[R * 4];
+  for (int i = 0; i < R * 4; ++i)
+    padded[i] = i < n ? keys[i] : UINT64_MAX;
+  const __m256i sign = _mm256_set1_epi64x(1UL << 63);
+  __m256i key[R], slot[R];
+  for (int r = 0; r < R; ++r) {
+    key[r] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(padded + r * 4)), sign);
+    slot[r] = _mm256_setr_epi64x(r * 4, r * 4 + 1, r * 4 + 2, r * 4 + 3);
+  }
+  BitonicStep<R, 2, 1>(key, slot);
+  BitonicStep<R, 4, 2>(key, slot);
+  BitonicStep<R, 4, 1>(key, slot);
+  if constexpr (R >= 2) {
+    BitonicStep<R, 8, 4>(key, slot);
+    BitonicStep<R, 8, 2>(key, slot);
+    BitonicStep<R, 8, 1>(key, slot);
+  }
+  if constexpr (R == 4) {
+    BitonicStep<R, 16, 8>(key, slot);
+    BitonicStep<R, 16, 4>(key, slot);
+    BitonicStep<R, 16, 2>(key, slot);
+    BitonicStep<R, 16, 1>(key, slot);
+  }
+  for (int r = 0; r < R; ++r)
+    _mm256_storeu_si256((__m256i*)(slots + r * 4), slot[r]);
+}
+#endif
+
+// slots of keys[0, n) in key order, n <= 16. keys are padded to a power
+// of two lanes with UINT64_MAX and sorted by a bitonic network with their
+// slots, then padding lanes are dropped. a key of UINT64_MAX may be
+// placed after padding lanes, so padding is filtered rather than cut.
+ALWAYS_INLINE void SortSlots(const uint64_t* keys, int n, int* sorted_index) {
+  assert(n <= 16);
+#if defined(__AVX512F__) || defined(__AVX2__)
+  // comparator sort is faster on a few keys
+#if defined(__AVX512F__)
+  const int simd_min_keys = 6;
+#else
+  const int simd_min_keys = 8;
+#endif
+  if (n < simd_min_keys) {
+    ScalarSortSlots(keys, n, sorted_index);
+    return;
+  }
+  int64_t slots[16];
+#if defined(__AVX512F__)
+  if (n <= 8)
+    SIMDSortSlots<1>(keys, n, slots);
+  else
+    SIMDSortSlots<2>(keys, n, slots);
+#else
+  if (n <= 8)
+    SIMDSortSlots<2>(keys, n, slots);
+  else
+    SIMDSortSlots<4>(keys, n, slots);
+#endif
+  for (int i = 0, cnt = 0; cnt < n; ++i)
+    if (slots[i] < n)
+      sorted_index[cnt++] = slots[i];
+#else
+  ScalarSortSlots(keys, n, sorted_index);
+#endif
+}
+
 template<const size_t buf_size, const size_t value_size = 8>
 struct KVBuffer {
   union {
@@ -39,31 +364,8 @@ struct KVBuffer {
   }
 
   ALWAYS_INLINE uint64_t key(int idx, uint64_t key_prefix) const {
-    static uint64_t prefix_mask[9] = {
-      0x0000000000000000UL,
-      0xFF00000000000000UL,
-      0xFFFF000000000000UL,
-      0xFFFFFF0000000000UL,
-      0xFFFFFFFF00000000UL,
-      0xFFFFFFFFFF000000UL,
-      0xFFFFFFFFFFFF0000UL,
-      0xFFFFFFFFFFFFFF00UL,
-      0xFFFFFFFFFFFFFFFFUL
-    };
-    static uint64_t suffix_mask[9] = {
-      0x0000000000000000UL,
-      0x00000000000000FFUL,
-      0x000000000000FFFFUL,
-      0x0000000000FFFFFFUL,
-      0x00000000FFFFFFFFUL,
-      0x000000FFFFFFFFFFUL,
-      0x0000FFFFFFFFFFFFUL,
-      0x00FFFFFFFFFFFFFFUL,
-      0xFFFFFFFFFFFFFFFFUL,
-    };
-
-    return (key_prefix & prefix_mask[prefix_bytes]) |
-           ((*(uint64_t*)pkey(idx)) & suffix_mask[suffix_bytes]);
+    return (key_prefix & kvbuffer_table.prefix_mask[prefix_bytes]) |
+           ((*(uint64_t*)pkey(idx)) & kvbuffer_table.suffix_mask[suffix_bytes]);
   }
 
   ALWAYS_INLINE uint64_t value(int idx) const {
@@ -71,7 +373,8 @@ struct KVBuffer {
     return *(uint64_t*)pvalue(idx) & (0xFFFFFFFFFFFFFFFFUL >> ((8-value_size)*8));
   }
 
-  int Find(uint64_t target, bool& find) const {
+  // fp: fingerprints of this buffer, nullptr if it has none
+  int Find(uint64_t target, bool& find, const Fingerprints* fp = nullptr) const {
 #ifdef BUF_SORT
     int left = 0;
     int right = entries - 1;
@@ -90,14 +393,15 @@ struct KVBuffer {
     find = false;
     return left;
 #else
-    for (int i = 0; i < entries; ++i) {
-      if (!memcmp(pkey(i), &target, suffix_bytes)) {
-        find = true;
-        return i;
-      }
-    }
-    find = false;
-    return entries;
+#ifdef BUF_FINGERPRINT
+    if (fp != nullptr)
+      return FingerprintFind(target, find, *fp);
+#endif
+#ifdef KVBUFFER_SIMD
+    return SIMDFind(target, find);
+#else
+    return ScalarFind(target, find);
+#endif
 #endif // BUF_SORT
   }
 
@@ -116,7 +420,26 @@ struct KVBuffer {
     }
     find = false;
     return entries - 1;
+#elif defined(KVBUFFER_SIMD)
+    return SIMDFindLE(target, find);
 #else
+    return ScalarFindLE(target, find);
+#endif
+  }
+
+#ifndef BUF_SORT
+  int ScalarFind(uint64_t target, bool& find) const {
+    for (int i = 0; i < entries; ++i) {
+      if (!memcmp(pkey(i), &target, suffix_bytes)) {
+        find = true;
+        return i;
+      }
+    }
+    find = false;
+    return entries;
+  }
+
+  int ScalarFindLE(uint64_t target, bool& find) const {
     int index = -1;
     uint64_t max_smaller_key = 0;
     for (int i = 0; i < entries; ++i) {
@@ -131,16 +454,156 @@ struct KVBuffer {
     }
     find = false;
     return index;
+  }
+#endif // BUF_SORT
+
+#ifdef BUF_FINGERPRINT
+  // keys are read only if some fingerprint matches, a miss usually reads
+  // nothing but meta and fingerprints
+  int FingerprintFind(uint64_t target, bool& find, const Fingerprints& fp) const {
+    uint64_t suffix_mask = kvbuffer_table.suffix_mask[suffix_bytes];
+    if (!fp.Match(Fingerprints::Hash(target & suffix_mask), entries)) {
+      find = false;
+      return entries;
+    }
+#ifdef KVBUFFER_SIMD
+    return SIMDFind(target, find);
+#else
+    return ScalarFind(target, find);
 #endif
   }
 
+  void BuildFingerprints(Fingerprints* fp) const {
+    for (int i = 0; i < entries; ++i)
+      fp->Set(i, Fingerprints::Hash(key(i, 0)));
+  }
+#endif // BUF_FINGERPRINT
+
+#ifdef KVBUFFER_SIMD
+  // compare target suffix with all keys at once: compare every byte of the
+  // key area with the repeated target suffix, a key is found if all of its
+  // suffix_bytes bytes are equal.
+  int SIMDFind(uint64_t target, bool& find) const {
+    if (!SIMDAvailable_())
+      return ScalarFind(target, find);
+    uint64_t equal = EqualBytes_(target);
+    uint64_t match = equal;
+    for (int i = 1; i < suffix_bytes; ++i)
+      match &= equal >> i;
+    match &= kvbuffer_table.key_start[suffix_bytes] & KeyAreaMask_();
+    if (match) {
+      find = true;
+      return __builtin_ctzll(match) / suffix_bytes;
+    }
+    find = false;
+    return entries;
+  }
+
+  // load keys into 64-bit lanes, then do unsigned compare and find the
+  // maximum smaller key. same result as ScalarFindLE().
+  int SIMDFindLE(uint64_t target, bool& find) const {
+    if (!SIMDAvailable_())
+      return ScalarFindLE(target, find);
+    uint64_t prefix = target & kvbuffer_table.prefix_mask[prefix_bytes];
+    uint64_t suffix_mask = kvbuffer_table.suffix_mask[suffix_bytes];
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+    __m256i offset = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                        _mm256_set1_epi32(suffix_bytes));
+    __m512i t = _mm512_set1_epi64(target);
+    __m512i mask = _mm512_set1_epi64(suffix_mask);
+    __m512i pre = _mm512_set1_epi64(prefix);
+    uint64_t valid = (1U << entries) - 1;
+    uint64_t equal = 0;
+    uint64_t smaller = 0;
+    __m512i keys[2];
+    // lane max of keys smaller than target
+    __m512i max = _mm512_setzero_si512();
+    for (int i = 0; i < 2; ++i) {
+      __mmask8 k = valid >> (i * 8);
+      keys[i] = _mm512_mask_i32gather_epi64(_mm512_setzero_si512(), k,
+          _mm256_add_epi32(offset, _mm256_set1_epi32(i * 8 * suffix_bytes)),
+          buf, 1);
+      keys[i] = _mm512_or_si512(_mm512_and_si512(keys[i], mask), pre);
+      equal |= (uint64_t)_mm512_mask_cmpeq_epu64_mask(k, keys[i], t) << (i * 8);
+      // scalar version never returns key 0
+      __mmask8 lt = _mm512_mask_cmplt_epu64_mask(k, keys[i], t) &
+                    _mm512_test_epi64_mask(keys[i], keys[i]);
+      smaller |= (uint64_t)lt << (i * 8);
+      max = _mm512_mask_max_epu64(max, lt, max, keys[i]);
+    }
+    if (equal) {
+      find = true;
+      return __builtin_ctzll(equal);
+    }
+    find = false;
+    if (!smaller)
+      return -1;
+    // maskz extract, gcc warns on the undefined source of plain extract
+    __m256i max256 = _mm256_max_epu64(_mm512_maskz_extracti64x4_epi64(0xF, max, 0),
+                                      _mm512_maskz_extracti64x4_epi64(0xF, max, 1));
+    __m128i max128 = _mm_max_epu64(_mm256_castsi256_si128(max256),
+                                   _mm256_extracti128_si256(max256, 1));
+    max = _mm512_set1_epi64(std::max<uint64_t>(_mm_cvtsi128_si64(max128),
+                                               _mm_extract_epi64(max128, 1)));
+    uint64_t index = _mm512_cmpeq_epu64_mask(keys[0], max) |
+                     ((uint64_t)_mm512_cmpeq_epu64_mask(keys[1], max) << 8);
+    return __builtin_ctzll(index & smaller);
+#else
+    __m128i offset = _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3),
+                                     _mm_set1_epi32(suffix_bytes));
+    // flip the sign bit for unsigned compare
+    __m256i sign = _mm256_set1_epi64x(1UL << 63);
+    __m256i t = _mm256_set1_epi64x(target);
+    __m256i signed_t = _mm256_xor_si256(t, sign);
+    __m256i mask = _mm256_set1_epi64x(suffix_mask);
+    __m256i pre = _mm256_set1_epi64x(prefix);
+    uint64_t keys[16];
+    uint32_t equal = 0;
+    uint32_t smaller = 0;
+    for (int i = 0; i * 4 < entries; ++i) {
+      __m256i valid = _mm256_cmpgt_epi64(_mm256_set1_epi64x(entries - i * 4),
+                                         _mm256_setr_epi64x(0, 1, 2, 3));
+      __m256i k = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(),
+          (const long long*)buf, _mm_add_epi32(offset, _mm_set1_epi32(i * 4 * suffix_bytes)),
+          valid, 1);
+      k = _mm256_or_si256(_mm256_and_si256(k, mask), pre);
+      _mm256_storeu_si256((__m256i*)&keys[i * 4], k);
+      __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi64(k, t), valid);
+      __m256i lt = _mm256_cmpgt_epi64(signed_t, _mm256_xor_si256(k, sign));
+      lt = _mm256_andnot_si256(_mm256_cmpeq_epi64(k, _mm256_setzero_si256()),
+                               _mm256_and_si256(lt, valid));
+      equal |= _mm256_movemask_pd(_mm256_castsi256_pd(eq)) << (i * 4);
+      smaller |= _mm256_movemask_pd(_mm256_castsi256_pd(lt)) << (i * 4);
+    }
+    if (equal) {
+      find = true;
+      return __builtin_ctz(equal);
+    }
+    find = false;
+    int index = -1;
+    uint64_t max_smaller_key = 0;
+    for (; smaller; smaller &= smaller - 1) {
+      int i = __builtin_ctz(smaller);
+      if (keys[i] > max_smaller_key) {
+        index = i;
+        max_smaller_key = keys[i];
+      }
+    }
+    return index;
+#endif // __AVX512F__ && __AVX512VL__
+  }
+#endif // KVBUFFER_SIMD
+
   ALWAYS_INLINE void Clear() {
     entries = 0;
     flush(&meta);
     fence();
   }
 
-  ALWAYS_INLINE bool Put(int pos, void* new_key, uint64_t value) {
+  // fingerprints are in the same cache line as meta of clevel node,
+  // they are persisted together with meta.
+  ALWAYS_INLINE bool Put(int pos, void* new_key, uint64_t value,
+                         Fingerprints* fp = nullptr) {
 #ifdef BUF_SORT
     memmove(pkey(pos+1), pkey(pos), suffix_bytes*(entries-pos));
     memmove(pvalue(entries), pvalue(entries-1), value_size*(entries-pos));
@@ -157,6 +620,10 @@ struct KVBuffer {
 #else
     memcpy(pkey(pos), new_key, suffix_bytes);
     memcpy(pvalue(pos), &value, value_size);
+#ifdef BUF_FINGERPRINT
+    if (fp != nullptr)
+      fp->Set(pos, Fingerprints::Hash(key(pos, 0)));
+#endif
     entries++;
     flush(pvalue(pos));
     fence();
@@ -165,11 +632,12 @@ struct KVBuffer {
 #endif // BUF_SORT
   }
 
-  ALWAYS_INLINE bool Put(int pos, uint64_t new_key, uint64_t value) {
-    return Put(pos, &new_key, value);
+  ALWAYS_INLINE bool Put(int pos, uint64_t new_key, uint64_t value,
+                         Fingerprints* fp = nullptr) {
+    return Put(pos, &new_key, value, fp);
   }
 
-  ALWAYS_INLINE bool Delete(int pos) {
+  ALWAYS_INLINE bool Delete(int pos, Fingerprints* fp = nullptr) {
 #ifdef BUF_SORT
     assert(pos < entries && pos >= 0);
     memmove(pkey(pos), pkey(pos+1), suffix_bytes*(entries-pos-1));
@@ -186,6 +654,10 @@ struct KVBuffer {
       // of entries, it will be fixed during recovery.
       memcpy(pkey(pos), pkey(entries - 1), suffix_bytes);
       memcpy(pvalue(pos), pvalue(entries - 1), value_size);
+#ifdef BUF_FINGERPRINT
+      if (fp != nullptr)
+        fp->Set(pos, fp->Get(entries - 1));
+#endif
       flush(pkey(pos));
       flush(pvalue(pos));
       fence();
@@ -197,6 +669,72 @@ struct KVBuffer {
 #endif // BUF_SORT
   }
 
+  // called after restart. a crash in Delete() after the key move leaves
+  // the last key twice, the move is redone. fp: fingerprints of this
+  // buffer, rebuilt
+  void Recover(Fingerprints* fp = nullptr) {
+#ifndef BUF_SORT
+    if (entries > 1) {
+      uint64_t last = key(entries - 1, 0);
+      for (int i = 0; i < entries - 1; ++i) {
+        if (key(i, 0) == last) {
+          memcpy(pvalue(i), pvalue(entries - 1), value_size);
+          flush(pvalue(i));
+          fence();
+          entries--;
+          flush(&meta);
+          fence();
+          break;
+        }
+      }
+    }
+#ifdef BUF_FINGERPRINT
+    if (fp != nullptr)
+      BuildFingerprints(fp);
+#endif
+#endif // BUF_SORT
+  }
+
+  // values of keys in [min_key, max_key] are added to stats. keys are
+  // checked in buffer order and nothing is sorted, no key is decoded if
+  // all_in_range. return false if some key is larger than max_key.
+  bool Aggregate(uint64_t key_prefix, uint64_t min_key, uint64_t max_key,
+                 bool all_in_range, ValueStats& stats) const {
+    static_assert(value_size == 8, "values are reduced as uint64_t");
+    if (entries == 0)
+      return true;
+    bool below_max = true;
+    uint32_t mask = 0;
+    if (all_in_range) {
+      mask = (1U << entries) - 1;
+    } else {
+      for (int i = 0; i < entries; ++i) {
+        uint64_t k = key(i, key_prefix);
+        if (k > max_key)
+          below_max = false;
+        else if (k >= min_key)
+          mask |= 1U << (entries - 1 - i);  // values are stored backwards
+      }
+    }
+    ReduceValues((const uint64_t*)pvalue(entries - 1), entries, mask, stats);
+    return below_max;
+  }
+
+  // fn(key, value) on pairs with keys in [min_key, max_key] in buffer
+  // order. return false if some key is larger than max_key.
+  template <typename Fn>
+  bool ForEach(uint64_t key_prefix, uint64_t min_key, uint64_t max_key, Fn&& fn) const {
+    bool below_max = true;
+    for (int i = 0; i < entries; ++i) {
+      uint64_t k = key(i, key_prefix);
+      if (k > max_key)
+        below_max = false;
+      else if (k >= min_key)
+        fn(k, value(i));
+    }
+    return below_max;
+  }
+
 #ifdef BUF_SORT
   // move data from this.[start_pos, entries) to dest.[0,entries-start_pos),
   // the start_pos and entries are the position of sorted order.
@@ -209,39 +747,132 @@ struct KVBuffer {
   }
 #else
   int GetSortedIndex(int sorted_index[buf_size/9]) const {
-    uint64_t keys[buf_size/9];
-    for (int i = 0; i < entries; ++i) {
+    uint64_t keys[16];
+    for (int i = 0; i < entries; ++i)
       keys[i] = key(i, 0);  // prefix does not matter
-      sorted_index[i] = i;
-    }
-    std::sort(&sorted_index[0], &sorted_index[entries],
-      [&keys](uint64_t a, uint64_t b) { return keys[a] < keys[b]; });
+    SortSlots(keys, entries, sorted_index);
     for (int i = 0; i < entries - 1; ++i) {
       assert(keys[sorted_index[i]] < keys[sorted_index[i + 1]]);
     }
     return entries;
   }
 
+  // like GetSortedIndex(), but reuses the order cached in cache by the last
+  // call. nibble i of cache is the slot of the i-th smallest key, bits
+  // 48-51 are the number of sorted slots n and bits 52-63 are tag. the
+  // cached order is used only if tag matches and it is still strictly
+  // increasing over slots [0, n), so writers never invalidate it. slots
+  // appended since are insertion merged and the new order is cached.
+  int GetSortedIndex(int sorted_index[buf_size/9], std::atomic<uint64_t>& cache,
+                     uint64_t tag) const {
+    static_assert(buf_size/9 <= 12, "sorted order does not fit in cache");
+    uint64_t keys[16];
+    for (int i = 0; i < entries; ++i)
+      keys[i] = key(i, 0);  // prefix does not matter
+    tag &= 0xfff;
+    uint64_t word = cache.load(std::memory_order_relaxed);
+    int n = (word >> 48) & 0xf;
+    if ((word >> 52) != tag || n > entries)
+      n = 0;
+    for (int i = 0; i < n; ++i) {
+      sorted_index[i] = (word >> (i * 4)) & 0xf;
+      if (sorted_index[i] >= n ||
+          (i > 0 && keys[sorted_index[i - 1]] >= keys[sorted_index[i]])) {
+        n = 0;
+        break;
+      }
+    }
+    if (n == entries)
+      return entries;
+    if (n == 0) {
+      SortSlots(keys, entries, sorted_index);
+    } else {
+      for (int i = n; i < entries; ++i) {
+        int j = i;
+        for (; j > 0 && keys[sorted_index[j - 1]] > keys[i]; --j)
+          sorted_index[j] = sorted_index[j - 1];
+        sorted_index[j] = i;
+      }
+    }
+    word = (tag << 52) | ((uint64_t)entries << 48);
+    for (int i = 0; i < entries; ++i)
+      word |= (uint64_t)sorted_index[i] << (i * 4);
+    cache.store(word, std::memory_order_relaxed);
+    return entries;
+  }
+
   // copy data from this.[start_pos, entries) to dest.[0,entries-start_pos),
   // the start_pos and entries are the position of sorted order.
-  void CopyData(KVBuffer<buf_size, value_size>* dest, int start_pos, int* sorted_index) const {
+  // dest_fp: fingerprints of dest
+  void CopyData(KVBuffer<buf_size, value_size>* dest, int start_pos, int* sorted_index,
+                Fingerprints* dest_fp = nullptr) const {
     for (int i = start_pos; i < entries; ++i) {
       memcpy(dest->pkey(i-start_pos), pkey(sorted_index[i]), suffix_bytes);
       memcpy(dest->pvalue(i-start_pos), pvalue(sorted_index[i]), value_size);
+#ifdef BUF_FINGERPRINT
+      if (dest_fp != nullptr)
+        dest_fp->Set(i-start_pos, Fingerprints::Hash(key(sorted_index[i], 0)));
+#endif
     }
     dest->entries = entries - start_pos;
   }
 
-  void DeleteData(int start_pos, int* sorted_index) {
-    int index[buf_size/9];
-    int delete_cnt = entries - start_pos;
-    memcpy(&index[0], &sorted_index[start_pos], delete_cnt*sizeof(int));
-    std::sort(&index[0], &index[delete_cnt]);
+  // write pairs to [pos, pos+count), entries is not changed and nothing
+  // is persisted. fp: fingerprints of this buffer
+  void WriteData(int pos, const uint64_t* keys, const uint64_t* values, int count,
+                 Fingerprints* fp = nullptr) {
+    for (int i = 0; i < count; ++i) {
+      memcpy(pkey(pos+i), &keys[i], suffix_bytes);
+      memcpy(pvalue(pos+i), &values[i], value_size);
+#ifdef BUF_FINGERPRINT
+      if (fp != nullptr)
+        fp->Set(pos+i, Fingerprints::Hash(key(pos+i, 0)));
+#endif
+    }
+  }
+
+  void DeleteData(int start_pos, int* sorted_index, Fingerprints* fp = nullptr) {
+    uint32_t slots = 0;
+    for (int i = start_pos; i < entries; ++i)
+      slots |= 1U << sorted_index[i];
     // delete entries from bigger index to smaller index
-    for (int i = delete_cnt - 1; i >= 0; --i)
-      Delete(index[i]);
+    while (slots) {
+      int index = 31 - __builtin_clz(slots);
+      Delete(index, fp);
+      slots &= ~(1U << index);
+    }
   }
 #endif // BUF_SORT
+#ifdef KVBUFFER_SIMD
+ private:
+  // the whole key area can be loaded by one 64-byte load
+  ALWAYS_INLINE bool SIMDAvailable_() const {
+    return buf_size >= 64 && entries * suffix_bytes <= 64;
+  }
+
+  // bits of the bytes in key area
+  ALWAYS_INLINE uint64_t KeyAreaMask_() const {
+    int bytes = entries * suffix_bytes;
+    return bytes == 64 ? ~0UL : (1UL << bytes) - 1;
+  }
+
+  // bit i is set if buf[i] == byte (i % suffix_bytes) of target
+  ALWAYS_INLINE uint64_t EqualBytes_(uint64_t target) const {
+    const uint8_t* pattern = kvbuffer_table.suffix_pattern[suffix_bytes];
+#ifdef __AVX512BW__
+    __m512i t = _mm512_shuffle_epi8(_mm512_set1_epi64(target),
+                                    _mm512_load_si512(pattern));
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(buf), t);
+#else
+    __m256i target_vec = _mm256_set1_epi64x(target);
+    __m256i t0 = _mm256_shuffle_epi8(target_vec, _mm256_load_si256((const __m256i*)pattern));
+    __m256i t1 = _mm256_shuffle_epi8(target_vec, _mm256_load_si256((const __m256i*)(pattern + 32)));
+    uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)buf), t0));
+    uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + 32)), t1));
+    return ((uint64_t)hi << 32) | lo;
+#endif // __AVX512BW__
+  }
+#endif // KVBUFFER_SIMD
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include "pmem.h"
+
+namespace combotree {
+
+// give up cpu after spinning for a while, the lock holder may have been
+// scheduled out
+ALWAYS_INLINE void spin_wait(int spin) {
+  if (spin < 128)
+    _mm_pause();
+  else
+    std::this_thread::yield();
+}
+
+// reader-writer spin lock in one word, so that a lock per blevel entry
+// costs 8 bytes instead of 56 bytes of std::shared_mutex. a waiting writer
+// blocks new readers, so writers are not starved by readers.
+class RWSpinLock {
+ public:
+  RWSpinLock() : state_(0) {}
+
+  ALWAYS_INLINE void lock() {
+    uint64_t state = state_.load(std::memory_order_relaxed);
+    for (int spin = 0; ; ++spin) {
+      if ((state & ~WRITER_WAIT) == 0) {
+        // clear WRITER_WAIT, other waiting writers will set it again
+        if (state_.compare_exchange_weak(state, WRITER, std::memory_order_acquire))
+          return;
+      } else if (!(state & WRITER_WAIT)) {
+        state_.fetch_or(WRITER_WAIT, std::memory_order_relaxed);
+      }
+      spin_wait(spin);
+      state = state_.load(std::memory_order_relaxed);
+    }
+  }
+
+  ALWAYS_INLINE void unlock() {
+    state_.fetch_and(~WRITER, std::memory_order_release);
+  }
+
+  ALWAYS_INLINE void lock_shared() {
+    uint64_t state = state_.load(std::memory_order_relaxed);
+    for (int spin = 0; ; ++spin) {
+      if (!(state & (WRITER | WRITER_WAIT)) &&
+          state_.compare_exchange_weak(state, state + READER, std::memory_order_acquire))
+        return;
+      spin_wait(spin);
+      state = state_.load(std::memory_order_relaxed);
+    }
+  }
+
+  ALWAYS_INLINE void unlock_shared() {
+    state_.fetch_sub(READER, std::memory_order_release);
+  }
+
+ private:
+  // | reader count | WRITER_WAIT | WRITER |
+  static const uint64_t WRITER      = 1;
+  static const uint64_t WRITER_WAIT = 2;
+  static const uint64_t READER      = 4;
+
+  std::atomic<uint64_t> state_;
+};
+
+static_assert(sizeof(RWSpinLock) == 8, "sizeof(RWSpinLock) != 8");
+
+// seqlock. version is odd while a writer holds the lock, readers never
+// write the lock: they get the version before reading and validate it
+// after reading, and retry if a writer has been in between.
+class VersionLock {
+ public:
+  VersionLock() : version_(0) {}
+
+  ALWAYS_INLINE void lock() {
+    uint64_t version = version_.load(std::memory_order_relaxed);
+    for (int spin = 0; ; ++spin) {
+      if (!(version & 1) &&
+          version_.compare_exchange_weak(version, version + 1,
+                                         std::memory_order_acquire))
+        return;
+      spin_wait(spin);
+      version = version_.load(std::memory_order_relaxed);
+    }
+  }
+
+  ALWAYS_INLINE void unlock() {
+    version_.fetch_add(1, std::memory_order_release);
+  }
+
+  // wait until no writer, return current version
+  ALWAYS_INLINE uint64_t ReadBegin() const {
+    uint64_t version = version_.load(std::memory_order_acquire);
+    for (int spin = 0; version & 1; ++spin) {
+      spin_wait(spin);
+      version = version_.load(std::memory_order_acquire);
+    }
+    return version;
+  }
+
+  // return true if nothing is changed since ReadBegin()
+  ALWAYS_INLINE bool Validate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return version_.load(std::memory_order_relaxed) == version;
+  }
+
+ private:
+  std::atomic<uint64_t> version_;
+};
+
+static_assert(sizeof(VersionLock) == 8, "sizeof(VersionLock) != 8");
+
+} // namespace combotree
@@ -11,6 +11,7 @@ namespace {
 const std::string DEFAULT_PMEMKV_PATH = "pmemkv";
 const std::string DEFAULT_PMEM_PATH = "blevel";
 const std::string DEFAULT_PMEMOBJ_PATH = "clevel";
+const std::string DEFAULT_ALEVEL_PATH = "alevel";
 
 } // anonymous namespace
 
@@ -33,9 +34,12 @@ class Manifest {
           pop_, root_->clevel_path, dir_ + DEFAULT_PMEMOBJ_PATH);
       root_->is_combo_tree = 0;
       root_->combo_tree_seq = 0;
+      root_->blevel_id = -1;
       root_.persist();
+      std::filesystem::remove(ALevelPath());
     } else {
-      assert(0);
+      pop_ = pmem::obj::pool<Root>::open(dir_ + "Manifest", "Combo Tree Manifest");
+      root_ = pop_.root();
     }
   }
 
@@ -47,6 +51,11 @@ class Manifest {
     return *root_->blevel_path;
   }
 
+  // model of current alevel, see ALevel::Persist()
+  const std::string ALevelPath() const {
+    return dir_ + DEFAULT_ALEVEL_PATH;
+  }
+
   const std::string CLevelPath() const {
     return *root_->clevel_path + std::string("-") +
            std::to_string(root_->combo_tree_seq);
@@ -67,6 +76,15 @@ class Manifest {
         sizeof(is_combo_tree));
   }
 
+  // blevel in use, reopened after restart
+  int BLevelId() const {
+    return root_->blevel_id;
+  }
+
+  void SetBLevelId(int blevel_id) {
+    pop_.memcpy_persist(&root_->blevel_id, &blevel_id, sizeof(blevel_id));
+  }
+
  private:
   std::string dir_; // combotree directory
   size_t size_;     // manifest file size
@@ -77,6 +95,7 @@ class Manifest {
     pmem::obj::persistent_ptr<std::string> clevel_path;
     int combo_tree_seq;
     int is_combo_tree;
+    int blevel_id;
   };
 
   pmem::obj::pool<Root> pop_;
@@ -20,4 +20,7 @@ static_assert(0, "cache line flush not supported!");
 #define fence _mm_sfence
 #define FENCE_METHOD  "_mm_sfence"
 
-#define ALWAYS_INLINE inline __attribute__((always_inline))
\ No newline at end of file
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// prefetch the cache line of addr into all cache levels
+#define prefetch(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
\ No newline at end of file
@@ -17,6 +17,9 @@ PmemKV::PmemKV(std::string path, size_t size,
                std::string engine, bool force_create)
     : write_ref_(0), read_ref_(0)
 {
+  // flags are left invalid by the migration of a previous tree
+  SetWriteValid();
+  SetReadValid();
   std::filesystem::remove(path);
   // // config cfg;
   // [[maybe_unused]] auto s = cfg.put_string("path", path);
@@ -74,16 +77,12 @@ bool PmemKV::Delete(uint64_t key) {
 size_t PmemKV::Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
                     std::vector<std::pair<uint64_t,uint64_t>>& kv) const {
   ReadRef_();
-  char key_buf[sizeof(uint64_t)];
-  int2char(min_key, key_buf);
-  for(auto kv_pair:kv_data) {
-    kv.emplace_back(kv_pair);
-  }
+  size_t count = 0;
+  for (auto it = kv_data.lower_bound(min_key);
+       it != kv_data.end() && it->first <= max_key && count < max_size; ++it, ++count)
+    kv.emplace_back(*it);
   ReadUnRef_();
-  std::sort(kv.begin(), kv.end());
-  if (kv.size() > max_size)
-    kv.resize(max_size);
-  return kv.size();
+  return count;
 }
 
 size_t PmemKV::Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
@@ -61,6 +61,7 @@ int main(int argc, char** argv) {
   std::cout << "EXPANSION_FACTOR:      " << EXPANSION_FACTOR << std::endl;
   std::cout << "PMEMKV_THRESHOLD:      " << PMEMKV_THRESHOLD << std::endl;
   std::cout << "SCAN_SIZE:             " << SCAN_SIZE << std::endl;
+  std::cout << "SCAN_PREFETCH_DISTANCE: " << SCAN_PREFETCH_DISTANCE << std::endl;
 
 #ifdef STREAMING_STORE
   std::cout << "STREAMING_STORE = 1" << std::endl;
@@ -70,6 +71,14 @@ int main(int argc, char** argv) {
   std::cout << "STREAMING_LOAD  = 1" << std::endl;
 #endif
 
+#ifdef BUF_FINGERPRINT
+  std::cout << "BUF_FINGERPRINT = 1" << std::endl;
+#endif
+
+#ifdef ASYNC_FLUSH
+  std::cout << "ASYNC_FLUSH     = 1" << std::endl;
+#endif
+
   std::vector<uint64_t> key;
 
   if (use_data_file) {
@@ -116,6 +125,9 @@ int main(int argc, char** argv) {
   std::cout << "size:           " << tree->Size() << std::endl;
   std::cout << "usage:          " << human_readable(tree->Usage()) << std::endl;
   std::cout << "bytes-per-pair: " << (double)tree->Usage() / tree->Size() << std::endl;
+  std::cout << "lock usage:     " << human_readable(tree->LockUsage()) << std::endl;
+  std::cout << "filter usage:   " << human_readable(tree->FilterUsage()) << std::endl;
+  std::cout << "reclaimable:    " << human_readable(tree->ReclaimableUsage()) << std::endl;
   tree->BLevelCompression();
 
   // Get
@@ -130,9 +142,15 @@ int main(int argc, char** argv) {
   total_time = timer.Microsecond("stop", "start");
   std::cout << "get: " << total_time/1000000.0 << " " << (double)GET_SIZE/(double)total_time*1000000.0 << std::endl;
 
-  for (uint64_t i = TEST_SIZE; i < TEST_SIZE+10000; ++i) {
+  // Get absent keys
+  timer.Clear();
+  timer.Record("start");
+  for (uint64_t i = TEST_SIZE; i < TEST_SIZE+GET_SIZE; ++i) {
     assert(tree->Get(i, value) == false);
   }
+  timer.Record("stop");
+  total_time = timer.Microsecond("stop", "start");
+  std::cout << "get miss: " << total_time/1000000.0 << " " << (double)GET_SIZE/(double)total_time*1000000.0 << std::endl;
 
   // scan
   timer.Clear();
@@ -151,6 +169,79 @@ int main(int argc, char** argv) {
   total_time = timer.Microsecond("stop", "start");
   std::cout << "scan " << SCAN_SIZE << ": " << total_time/1000000.0 << " " << (double)SCAN_TEST_SIZE/(double)total_time*1000000.0 << std::endl;
 
+  // Iter vs Scan() into an array, scans per second
+  std::vector<combotree::Pair> results(10000);
+  for (int scan_size : {10, 100, 1000, 10000}) {
+    int scan_cnt = std::min(SCAN_TEST_SIZE, 100000000 / scan_size);
+    timer.Clear();
+    timer.Record("iter_start");
+    for (int i = 0; i < scan_cnt; ++i) {
+      ComboTree::Iter iter(tree, key[i]);
+      for (int j = 0; j < scan_size && !iter.end(); ++j) {
+        results[j].key = iter.key();
+        results[j].value = iter.value();
+        iter.next();
+      }
+    }
+    timer.Record("iter_stop");
+    for (int i = 0; i < scan_cnt; ++i) {
+      size_t cnt = tree->Scan(key[i], UINT64_MAX, scan_size, results.data());
+      assert(cnt == std::min<size_t>(scan_size, TEST_SIZE - key[i]));
+      assert(results[cnt-1].key == key[i] + cnt - 1);
+    }
+    timer.Record("scan_stop");
+    uint64_t iter_time = timer.Microsecond("iter_stop", "iter_start");
+    uint64_t scan_time = timer.Microsecond("scan_stop", "iter_stop");
+    std::cout << "scan " << std::setw(5) << scan_size << " iter: "
+              << (double)scan_cnt/(double)iter_time*1000000.0 << " Scan(): "
+              << (double)scan_cnt/(double)scan_time*1000000.0 << std::endl;
+  }
+
+  // descending scans from SeekForPrev(), scans per second
+  for (int scan_size : {10, 100, 1000, 10000}) {
+    int scan_cnt = std::min(SCAN_TEST_SIZE, 100000000 / scan_size);
+    ComboTree::ReverseIter riter(tree, 0);
+    timer.Clear();
+    timer.Record("start");
+    for (int i = 0; i < scan_cnt; ++i) {
+      riter.SeekForPrev(key[i]);
+      for (int j = 0; j < scan_size && !riter.end(); ++j) {
+        assert(riter.key() == key[i] - j);
+        results[j].key = riter.key();
+        results[j].value = riter.value();
+        riter.next();
+      }
+    }
+    timer.Record("stop");
+    total_time = timer.Microsecond("stop", "start");
+    std::cout << "reverse scan " << std::setw(5) << scan_size << ": "
+              << (double)scan_cnt/(double)total_time*1000000.0 << std::endl;
+  }
+
+  // sum of values by Iter vs SumRange(), ranges per second
+  for (int range_size : {10, 100, 1000, 10000}) {
+    int range_cnt = std::min(SCAN_TEST_SIZE, 100000000 / range_size);
+    timer.Clear();
+    timer.Record("iter_start");
+    uint64_t iter_sum = 0;
+    for (int i = 0; i < range_cnt; ++i) {
+      uint64_t max_key = key[i] + range_size - 1;
+      for (ComboTree::Iter iter(tree, key[i]); !iter.end() && iter.key() <= max_key; iter.next())
+        iter_sum += iter.value();
+    }
+    timer.Record("iter_stop");
+    uint64_t range_sum = 0;
+    for (int i = 0; i < range_cnt; ++i)
+      range_sum += tree->SumRange(key[i], key[i] + range_size - 1);
+    timer.Record("sum_stop");
+    assert(iter_sum == range_sum);
+    uint64_t iter_time = timer.Microsecond("iter_stop", "iter_start");
+    uint64_t sum_time = timer.Microsecond("sum_stop", "iter_stop");
+    std::cout << "sum " << std::setw(5) << range_size << " iter: "
+              << (double)range_cnt/(double)iter_time*1000000.0 << " SumRange(): "
+              << (double)range_cnt/(double)sum_time*1000000.0 << std::endl;
+  }
+
   // Delete
   // for (auto& k : key) {
   //   assert(tree->Delete(k) == true);
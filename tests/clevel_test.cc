@@ -2,6 +2,9 @@
 #include <cstdlib>
 #include <cassert>
 #include <vector>
+#include <algorithm>
+#include <map>
+#include <string>
 #include "clevel.h"
 #include "random.h"
 
@@ -78,5 +81,158 @@ int main(void) {
     assert(value == i);
   }
 
+  // nodes emptied by deletes are merged and freed
+  assert(mem.FreeUsage() > 0);
+  CLevel::Iter del_iter(&clevel, &mem, 0);
+  for (uint64_t i = TEST_SIZE / 2; i < TEST_SIZE; ++i) {
+    assert(del_iter.key() == i);
+    assert(del_iter.next() == (i != TEST_SIZE - 1));
+  }
+
+  // delete the rest in random order, then freed nodes are reused
+  for (int i = 0; i < TEST_SIZE; ++i) {
+    uint64_t value;
+    assert(clevel.Delete(&mem, key[i], &value) == (key[i] >= TEST_SIZE / 2));
+  }
+  assert(CLevel::Iter(&clevel, &mem, 0).end());
+  uint64_t usage = mem.Usage() + mem.FreeUsage();
+  for (int i = 0; i < TEST_SIZE; ++i)
+    assert(clevel.Put(&mem, key[i], key[i]) == true);
+  assert(mem.Usage() + mem.FreeUsage() == usage);
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    uint64_t value;
+    assert(clevel.Get(&mem, i, value) == true);
+    assert(value == i);
+  }
+
+  // a leaf grows on delete only when its right sibling is merged into it,
+  // merged leaves are at most 3/4 full
+  {
+    const uint64_t MERGE_SIZE = 4000;
+    void* merge_addr = malloc(MERGE_SIZE * 40);
+    CLevel::MemControl merge_mem(merge_addr, MERGE_SIZE * 40);
+    CLevel merge_clevel;
+    merge_clevel.Setup(&merge_mem, 4);
+    for (int i = 0; i < TEST_SIZE; ++i)
+      if (key[i] < MERGE_SIZE)
+        assert(merge_clevel.Put(&merge_mem, key[i], key[i]) == true);
+    // size of leaves by their smallest key
+    auto leaf_sizes = [&]() {
+      std::map<uint64_t, int> sizes;
+      merge_clevel.ScanLeaves(&merge_mem, 0, 0,
+          [&](const uint64_t* keys, const uint64_t* values, int n) {
+            sizes[keys[0]] = n;
+            return true;
+          });
+      return sizes;
+    };
+    const int limit = (48 + 64) / (4 + 8) * 3 / 4;
+    int merged = 0;
+    std::map<uint64_t, int> before = leaf_sizes();
+    // in descending order, the left sibling is not deleted from yet
+    for (uint64_t i = MERGE_SIZE - 1; i > 0; --i) {
+      uint64_t value;
+      if (i % 4 == 0)
+        continue;
+      assert(merge_clevel.Delete(&merge_mem, i, &value) == true);
+      std::map<uint64_t, int> after = leaf_sizes();
+      for (auto& leaf : after) {
+        auto it = before.find(leaf.first);
+        if (it != before.end() && leaf.second > it->second) {
+          assert(leaf.second <= limit);
+          merged++;
+        }
+      }
+      before.swap(after);
+    }
+    assert(merged > 0);
+    free(merge_addr);
+  }
+
+  // a merge stopped after any of its persist steps, as by a crash, is
+  // finished when the clevel is reopened. keys deleted later must not
+  // come back in a scan.
+  for (int step = 1; step <= 4; ++step) {
+    const uint64_t CRASH_SIZE = 2000;
+    const size_t crash_max_size = 1024 * 1024 * 1024UL;
+    const size_t crash_segment_size = 2 * 1024 * 1024UL;
+    std::string crash_file = std::string(CLEVEL_PMEM_FILE) + "crash-test";
+    std::map<uint64_t, uint64_t> expect;
+    CLevel crash_clevel;
+    {
+      CLevel::MemControl crash_mem(crash_file, crash_max_size, crash_segment_size);
+      crash_clevel.Setup(&crash_mem, 4);
+      for (uint64_t i = 0; i < CRASH_SIZE; ++i) {
+        assert(crash_clevel.Put(&crash_mem, i, i) == true);
+        expect[i] = i;
+      }
+      crash_mem.merge_crash_step = step;
+      for (uint64_t i = CRASH_SIZE - 1; i > 0 && crash_mem.merge_crash_step != -1; --i) {
+        if (i % 4 == 0)
+          continue;
+        assert(crash_clevel.Delete(&crash_mem, i, nullptr) == true);
+        expect.erase(i);
+      }
+      assert(crash_mem.merge_crash_step == -1);
+      crash_mem.KeepFiles();
+    }
+
+    CLevel::MemControl crash_mem(crash_file, crash_max_size, crash_segment_size, false);
+    auto check = [&]() {
+      auto it = expect.begin();
+      for (CLevel::Iter iter(&crash_clevel, &crash_mem, 0); !iter.end(); iter.next(), ++it) {
+        assert(it != expect.end());
+        assert(iter.key() == it->first && iter.value() == it->second);
+      }
+      assert(it == expect.end());
+      for (uint64_t i = 0; i < CRASH_SIZE; ++i) {
+        uint64_t value;
+        assert(crash_clevel.Get(&crash_mem, i, value) == (expect.count(i) == 1));
+      }
+    };
+    check();
+    for (uint64_t i = 0; i < CRASH_SIZE; i += 2) {
+      if (expect.count(i)) {
+        assert(crash_clevel.Delete(&crash_mem, i, nullptr) == true);
+        expect.erase(i);
+      }
+    }
+    check();
+  }
+
+  // PutBatch: sorted batches of random size, every other batch updates
+  // keys put before
+  void* batch_addr = malloc(TEST_SIZE * 40);
+  CLevel::MemControl batch_mem(batch_addr, TEST_SIZE * 40);
+  CLevel batch_clevel;
+  batch_clevel.Setup(&batch_mem, 4);
+  Random batch_rnd(1, CLevel::MAX_BATCH);
+  uint64_t batch_keys[CLevel::MAX_BATCH];
+  uint64_t batch_values[CLevel::MAX_BATCH];
+  for (int i = 0; i < TEST_SIZE; ) {
+    int cnt = std::min((int)batch_rnd.Next(), TEST_SIZE - i);
+    for (int j = 0; j < cnt; ++j)
+      batch_keys[j] = key[i + j];
+    std::sort(&batch_keys[0], &batch_keys[cnt]);
+    for (int j = 0; j < cnt; ++j)
+      batch_values[j] = batch_keys[j] + 1;
+    assert(batch_clevel.PutBatch(&batch_mem, batch_keys, batch_values, cnt) == cnt);
+    for (int j = 0; j < cnt; ++j)
+      batch_values[j] = batch_keys[j];
+    assert(batch_clevel.PutBatch(&batch_mem, batch_keys, batch_values, cnt) == 0);
+    i += cnt;
+  }
+
+  CLevel::Iter batch_iter(&batch_clevel, &batch_mem, 0);
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    uint64_t value;
+    assert(batch_clevel.Get(&batch_mem, i, value) == true);
+    assert(value == i);
+    assert(batch_iter.key() == i);
+    assert(batch_iter.value() == i);
+    assert(batch_iter.next() == (i != TEST_SIZE - 1));
+  }
+  free(batch_addr);
+
   return 0;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <map>
 #include "combotree/combotree.h"
 #include "combotree_config.h"
+#include "blevel.h"
 #include "random.h"
 
 #define TEST_SIZE   4000000
@@ -22,6 +23,7 @@ int main(void) {
   std::cout << "BLEVEL_EXPAND_BUF_KEY: " << BLEVEL_EXPAND_BUF_KEY << std::endl;
   std::cout << "EXPANSION_FACTOR:      " << EXPANSION_FACTOR << std::endl;
   std::cout << "PMEMKV_THRESHOLD:      " << PMEMKV_THRESHOLD << std::endl;
+  std::cout << "EXPANSION_THREADS:     " << EXPANSION_THREADS << std::endl;
 
 #ifdef STREAMING_STORE
   std::cout << "STREAMING_STORE = 1" << std::endl;
@@ -115,5 +117,299 @@ int main(void) {
     }
   }
 
+  // Scan() of random ranges
+  {
+    std::vector<std::pair<uint64_t, uint64_t>> results;
+    std::vector<combotree::Pair> pairs(1000);
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t min_key = rnd.Next();
+      uint64_t max_key = i % 2 ? UINT64_MAX : min_key + (rnd.Next() >> 20);
+      size_t max_size = i % 1000;
+      results.clear();
+      size_t cnt = tree->Scan(min_key, max_key, max_size, results);
+      assert(cnt == results.size());
+      assert(tree->Scan(min_key, max_key, max_size, pairs.data()) == cnt);
+      auto it = right_kv.lower_bound(min_key);
+      for (size_t j = 0; j < cnt; ++j, ++it) {
+        assert(results[j].first == it->first && results[j].second == it->second);
+        assert(pairs[j].key == it->first && pairs[j].value == it->second);
+      }
+      assert(cnt == max_size || it == right_kv.end() || it->first > max_key);
+    }
+  }
+
+  // ReverseIter and SeekForPrev()
+  {
+    ComboTree::ReverseIter riter(tree);
+    for (auto it = right_kv.rbegin(); it != right_kv.rend(); ++it) {
+      assert(!riter.end());
+      assert(riter.key() == it->first && riter.value() == it->second);
+      riter.next();
+    }
+    assert(riter.end());
+
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t start_key = rnd.Next();
+      riter.SeekForPrev(start_key);
+      auto it = std::make_reverse_iterator(right_kv.upper_bound(start_key));
+      for (int j = 0; j < 100 && it != right_kv.rend(); ++j, ++it) {
+        assert(!riter.end());
+        assert(riter.key() == it->first && riter.value() == it->second);
+        riter.next();
+      }
+      assert(it != right_kv.rend() || riter.end());
+    }
+  }
+
+  // ParallelScan() of random ranges, chunks in order give key order
+  {
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> results;
+    for (int i = 0; i < 100; ++i) {
+      uint64_t min_key = rnd.Next();
+      uint64_t max_key = i % 10 ? min_key + (rnd.Next() >> 4) : UINT64_MAX;
+      results.clear();
+      size_t cnt = tree->ParallelScan(min_key, max_key, 1 + i % 16, 4, results);
+      auto it = right_kv.lower_bound(min_key);
+      size_t total = 0;
+      for (auto& chunk : results) {
+        for (auto& kv : chunk) {
+          assert(it != right_kv.end() && kv.first == it->first && kv.second == it->second);
+          ++it;
+        }
+        total += chunk.size();
+      }
+      assert(total == cnt);
+      assert(it == right_kv.end() || it->first > max_key);
+    }
+  }
+
+  // AggregateRange() and ReduceRange() of random ranges
+  {
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t min_key = rnd.Next();
+      uint64_t max_key = i % 100 ? min_key + (rnd.Next() >> 12) : UINT64_MAX;
+      size_t count = 0;
+      uint64_t sum = 0, min_value = UINT64_MAX, max_value = 0;
+      for (auto it = right_kv.lower_bound(min_key);
+           it != right_kv.end() && it->first <= max_key; ++it) {
+        count++;
+        sum += it->second;
+        min_value = std::min(min_value, it->second);
+        max_value = std::max(max_value, it->second);
+      }
+      combotree::RangeStats stats = tree->AggregateRange(min_key, max_key);
+      assert(stats.count == count && stats.sum == sum);
+      assert(stats.min_value == min_value && stats.max_value == max_value);
+      assert(tree->CountRange(min_key, max_key) == count);
+      assert(tree->SumRange(min_key, max_key) == sum);
+      size_t reduce_count = 0;
+      tree->ReduceRange(min_key, max_key, [&](uint64_t key, uint64_t value) {
+        assert(key >= min_key && key <= max_key && right_kv.at(key) == value);
+        reduce_count++;
+      });
+      assert(reduce_count == count);
+    }
+  }
+
+  // a reducer calls back into the tree, no entry lock is held
+  {
+    for (int i = 0; i < 100; ++i) {
+      uint64_t min_key = rnd.Next();
+      uint64_t max_key = min_key + (rnd.Next() >> 12);
+      size_t count = 0;
+      tree->ReduceRange(min_key, max_key, [&](uint64_t key, uint64_t value) {
+        uint64_t got;
+        assert(tree->Get(key, got) && got == value);
+        assert(tree->Delete(key));
+        assert(tree->Put(key, value));
+        count++;
+      });
+      assert(count == tree->CountRange(min_key, max_key));
+    }
+  }
+
+  // rescan a range while it is modified, cached sorted orders are reused
+  // and must follow new and deleted keys
+  {
+    for (int i = 0; i < 100; ++i) {
+      uint64_t start_key = rnd.Next();
+      for (int round = 0; round < 4; ++round) {
+        auto it = right_kv.lower_bound(start_key);
+        ComboTree::Iter iter(tree, start_key);
+        for (int j = 0; j < 200 && it != right_kv.end(); ++j, ++it) {
+          assert(iter.key() == it->first && iter.value() == it->second);
+          iter.next();
+        }
+        uint64_t new_key = start_key + (rnd.Next() >> 24);
+        if (right_kv.emplace(new_key, new_key).second)
+          tree->Put(new_key, new_key);
+        it = right_kv.upper_bound(start_key + (rnd.Next() >> 24));
+        if (it != right_kv.end()) {
+          assert(tree->Delete(it->first) == true);
+          right_kv.erase(it);
+        }
+      }
+    }
+  }
+
+  // contraction after deleting most keys
+  {
+    while (tree->IsExpanding()) ;
+    size_t entries = tree->BLevelEntries();
+    int cnt = 0;
+    for (auto it = right_kv.begin(); it != right_kv.end(); ) {
+      if (cnt++ % 20 != 0) {
+        assert(tree->Delete(it->first) == true);
+        it = right_kv.erase(it);
+      } else {
+        it++;
+      }
+    }
+    while (tree->IsExpanding()) ;
+    std::cout << "entries after deleting: " << entries << " -> "
+              << tree->BLevelEntries() << std::endl;
+    assert(tree->BLevelEntries() < entries);
+    assert(tree->Size() == right_kv.size());
+    ComboTree::Iter iter(tree);
+    for (auto &kv : right_kv) {
+      assert(tree->Get(kv.first, value) == true);
+      assert(value == kv.second);
+      assert(iter.key() == kv.first && iter.value() == kv.second);
+      iter.next();
+    }
+    assert(iter.end());
+
+    // explicit contraction of an empty tree
+    for (auto &kv : right_kv)
+      assert(tree->Delete(kv.first) == true);
+    while (tree->IsExpanding()) ;
+    tree->Contract();
+    assert(tree->BLevelEntries() == 1);
+    assert(tree->Size() == 0);
+    assert(ComboTree::Iter(tree).end());
+    assert(tree->Put(1, 1) == true);
+    assert(tree->Get(1, value) == true && value == 1);
+    right_kv.clear();
+    right_kv.emplace(1, 1);
+  }
+
+  // reopen after restart
+  {
+    for (uint64_t i = 0; i < TEST_SIZE / 10; ++i) {
+      uint64_t key = rnd.Next();
+      right_kv[key] = i;
+      tree->Put(key, i);
+    }
+    while (tree->IsExpanding()) ;
+    size_t entries = tree->BLevelEntries();
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), false);
+#else
+    tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), false);
+#endif
+    assert(tree->BLevelEntries() == entries);
+    assert(tree->Size() == right_kv.size());
+    ComboTree::Iter iter(tree);
+    for (auto &kv : right_kv) {
+      assert(tree->Get(kv.first, value) == true);
+      assert(value == kv.second);
+      assert(iter.key() == kv.first && iter.value() == kv.second);
+      iter.next();
+    }
+    assert(iter.end());
+  }
+
+  // bulk load unsorted pairs with duplicate keys into a new tree
+  {
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+#else
+    tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+#endif
+    right_kv.clear();
+    std::vector<std::pair<uint64_t,uint64_t>> pairs;
+    for (uint64_t i = 0; i < TEST_SIZE / 10; ++i) {
+      uint64_t key = i % 3 == 0 && i > 0 ? pairs[i / 2].first : rnd.Next();
+      pairs.emplace_back(key, i);
+      right_kv[key] = i;
+    }
+    assert(tree->BulkLoad(pairs, 4) == true);
+    assert(!tree->IsExpanding());
+    assert(tree->Size() == right_kv.size());
+    assert(tree->BLevelEntries() <=
+           (right_kv.size() + BLEVEL_EXPAND_BUF_KEY - 1) / BLEVEL_EXPAND_BUF_KEY + 1);
+    ComboTree::Iter iter(tree);
+    for (auto &kv : right_kv) {
+      assert(tree->Get(kv.first, value) == true);
+      assert(value == kv.second);
+      assert(iter.key() == kv.first && iter.value() == kv.second);
+      iter.next();
+    }
+    assert(iter.end());
+    assert(tree->BulkLoad(pairs.data(), pairs.size()) == false);
+  }
+
+  // seek into a range of deleted keys, entries there may be empty
+  {
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+#else
+    tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+#endif
+    for (uint64_t i = 1; i <= 200000; ++i)
+      tree->Put(i * 1000, i);
+    while (tree->IsExpanding()) ;
+    for (uint64_t i = 100000; i < 100100; ++i)
+      assert(tree->Delete(i * 1000) == true);
+    for (uint64_t start_key = 100000 * 1000; start_key <= 100100 * 1000; start_key += 500) {
+      ComboTree::Iter iter(tree, start_key);
+      assert(!iter.end() && iter.key() == 100100 * 1000 && iter.value() == 100100);
+    }
+  }
+
+  // parallel expansion builds the same blevel as the serial one
+  {
+    std::vector<std::pair<uint64_t,uint64_t>> init;
+    for (uint64_t i = 1; i <= 20000; ++i)
+      init.emplace_back(i * 100000, i);
+    for (int thread_num : {2, 3, 8}) {
+      // both old blevels get the same operations, clustered puts set up clevels
+      combotree::BLevel old_serial(init.size()), old_parallel(init.size());
+      old_serial.Expansion(init.data(), init.size());
+      old_parallel.Expansion(init.data(), init.size());
+      Random op_rnd(0, UINT64_MAX - 1);
+      bool migrated;
+      for (int i = 0; i < 200000; ++i) {
+        uint64_t key = init[op_rnd.Next() % init.size()].first + op_rnd.Next() % 1000;
+        old_serial.Put(key, i, 0, old_serial.Entries() - 1, migrated);
+        old_parallel.Put(key, i, 0, old_parallel.Entries() - 1, migrated);
+      }
+      for (uint64_t i = 1; i <= 20000; i += 3) {
+        old_serial.Delete(i * 100000, nullptr, 0, old_serial.Entries() - 1, migrated);
+        old_parallel.Delete(i * 100000, nullptr, 0, old_parallel.Entries() - 1, migrated);
+      }
+
+      combotree::BLevel serial(old_serial.Size()), parallel(old_parallel.Size());
+      serial.Expansion(&old_serial);
+      parallel.ParallelExpansion(&old_parallel, thread_num);
+      assert(serial.Entries() == parallel.Entries());
+      assert(serial.Size() == parallel.Size());
+      for (uint64_t i = 0; i < serial.Entries(); ++i)
+        assert(serial.EntryKey(i) == parallel.EntryKey(i));
+
+      std::vector<std::pair<uint64_t,uint64_t>> serial_kv, parallel_kv;
+      serial.Scan(0, UINT64_MAX, UINT64_MAX, 0, serial.Entries() - 1,
+          [&](uint64_t key, uint64_t value) { serial_kv.emplace_back(key, value); });
+      parallel.Scan(0, UINT64_MAX, UINT64_MAX, 0, parallel.Entries() - 1,
+          [&](uint64_t key, uint64_t value) { parallel_kv.emplace_back(key, value); });
+      assert(serial_kv.size() == serial.Size());
+      assert(serial_kv == parallel_kv);
+    }
+  }
+
+  delete tree;
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include <iostream>
+#include <iomanip>
+#include <cassert>
+#include <vector>
+#include "../src/kvbuffer.h"
+#include "random.h"
+#include "timer.h"
+
+#define CACHED_NODES  1024
+#define MEMORY_NODES  (1024*1024)
+#define QUERY_COUNT   (1024*1024)
+
+using combotree::KVBuffer;
+using combotree::Random;
+using combotree::Timer;
+
+#ifndef BUF_SORT
+// same layout as CLevel::Node, fingerprints are in the first cache line
+template<size_t value_size>
+struct alignas(64) Node {
+  uint8_t type;
+  combotree::Fingerprints fingerprints;
+  uint8_t next[6];
+  KVBuffer<112, value_size> buf;
+};
+
+// full nodes of random keys
+template<size_t value_size>
+void Bench(int suffix_bytes, int node_count, int rounds) {
+  using Buffer = KVBuffer<112, value_size>;
+  Random rnd(0, UINT32_MAX);
+  std::vector<Node<value_size>> nodes(node_count);
+  std::vector<uint64_t> prefix(node_count);
+  uint64_t suffix_mask = combotree::kvbuffer_table.suffix_mask[suffix_bytes];
+
+  for (int n = 0; n < node_count; ++n) {
+    Buffer& buf = nodes[n].buf;
+    buf.meta = 0;
+    buf.prefix_bytes = 8 - suffix_bytes;
+    buf.suffix_bytes = suffix_bytes;
+    buf.max_entries = std::min(buf.MaxEntries(), 15);
+    prefix[n] = ((rnd.Next() << 32) | rnd.Next()) & ~suffix_mask;
+    while (!buf.Full()) {
+      uint64_t key = prefix[n] | (((rnd.Next() << 32) | rnd.Next()) & suffix_mask);
+      bool exist;
+      buf.ScalarFind(key, exist);
+      if (!exist) {
+        memcpy(buf.pkey(buf.entries), &key, suffix_bytes);
+        memcpy(buf.pvalue(buf.entries), &key, value_size);
+        buf.entries++;
+      }
+    }
+  }
+
+  // even queries miss, odd queries hit
+  std::vector<int> query_node(QUERY_COUNT);
+  std::vector<uint64_t> query_key(QUERY_COUNT);
+  for (int i = 0; i < QUERY_COUNT; ++i) {
+    int n = rnd.Next() % node_count;
+    query_node[i] = n;
+    if (i % 2) {
+      query_key[i] = nodes[n].buf.key(rnd.Next() % nodes[n].buf.entries, prefix[n]);
+    } else {
+      bool exist;
+      do {
+        query_key[i] = prefix[n] | (((rnd.Next() << 32) | rnd.Next()) & suffix_mask);
+        nodes[n].buf.ScalarFind(query_key[i], exist);
+      } while (exist);
+    }
+  }
+
+#ifdef BUF_FINGERPRINT
+  // only leaf buffers have fingerprints
+  bool has_fingerprints = nodes[0].buf.max_entries <= combotree::Fingerprints::MAX_KEYS;
+  for (int n = 0; has_fingerprints && n < node_count; ++n)
+    nodes[n].buf.BuildFingerprints(&nodes[n].fingerprints);
+#endif
+
+  for (int i = 0; i < QUERY_COUNT; ++i) {
+    const Buffer& buf = nodes[query_node[i]].buf;
+    bool scalar_exist, exist;
+    int scalar_pos = buf.ScalarFind(query_key[i], scalar_exist);
+    int pos = buf.Find(query_key[i], exist);
+    assert(scalar_pos == pos && scalar_exist == exist && exist == (i % 2));
+#ifdef BUF_FINGERPRINT
+    if (has_fingerprints) {
+      pos = buf.Find(query_key[i], exist, &nodes[query_node[i]].fingerprints);
+      assert(scalar_pos == pos && scalar_exist == exist);
+    }
+#endif
+    scalar_pos = buf.ScalarFindLE(query_key[i], scalar_exist);
+    pos = buf.FindLE(query_key[i], exist);
+    assert(scalar_pos == pos && scalar_exist == exist);
+  }
+
+  // ns per query of hit (odd) or miss (even) queries, or all queries
+  auto time = [&](int start, int step, auto find) {
+    Timer timer;
+    volatile int sink = 0;
+    int sum = 0;
+    timer.Record("start");
+    for (int r = 0; r < rounds; ++r)
+      for (int i = start; i < QUERY_COUNT; i += step)
+        sum += find(nodes[query_node[i]], query_key[i]);
+    timer.Record("stop");
+    sink = sum;
+    (void)sink;
+    return timer.Microsecond("stop", "start") * 1000.0 / (QUERY_COUNT / step * rounds);
+  };
+
+  std::cout << std::fixed << std::setprecision(2)
+            << "KVBuffer<112," << value_size << "> suffix " << suffix_bytes
+            << " entries " << std::setw(2) << nodes[0].buf.entries;
+  for (int hit = 1; hit >= 0; --hit) {
+    std::cout << (hit ? "  hit " : "  miss ")
+              << time(hit, 2, [](const Node<value_size>& node, uint64_t key) {
+                   bool exist;
+                   return node.buf.ScalarFind(key, exist);
+                 })
+              << " -> " << time(hit, 2, [](const Node<value_size>& node, uint64_t key) {
+                   bool exist;
+                   return node.buf.Find(key, exist);
+                 });
+#ifdef BUF_FINGERPRINT
+    if (has_fingerprints)
+      std::cout << " / " << time(hit, 2, [](const Node<value_size>& node, uint64_t key) {
+                   bool exist;
+                   return node.buf.Find(key, exist, &node.fingerprints);
+                 });
+#endif
+  }
+  std::cout << "  FindLE "
+            << time(0, 1, [](const Node<value_size>& node, uint64_t key) {
+                 bool exist;
+                 return node.buf.ScalarFindLE(key, exist);
+               })
+            << " -> "
+            << time(0, 1, [](const Node<value_size>& node, uint64_t key) {
+                 bool exist;
+                 return node.buf.FindLE(key, exist);
+               })
+            << std::endl;
+}
+
+// sort nodes of n random keys, some nodes have a key of UINT64_MAX
+void BenchSort(int n, int node_count, int rounds) {
+  Random rnd(0, UINT32_MAX);
+  std::vector<uint64_t> keys(node_count * 16);
+  for (auto& key : keys)
+    key = (rnd.Next() << 32) | rnd.Next();
+  for (int i = 0; i < node_count; i += 7)
+    keys[i * 16 + rnd.Next() % n] = UINT64_MAX;
+
+  for (int i = 0; i < node_count; ++i) {
+    int scalar_index[16], index[16];
+    combotree::ScalarSortSlots(&keys[i * 16], n, scalar_index);
+    combotree::SortSlots(&keys[i * 16], n, index);
+    assert(std::equal(scalar_index, scalar_index + n, index));
+  }
+
+  // ns per node
+  auto time = [&](auto sort) {
+    Timer timer;
+    volatile int sink = 0;
+    int sum = 0;
+    timer.Record("start");
+    for (int r = 0; r < rounds; ++r) {
+      for (int i = 0; i < node_count; ++i) {
+        int index[16];
+        sort(&keys[i * 16], n, index);
+        sum += index[0];
+      }
+    }
+    timer.Record("stop");
+    sink = sum;
+    (void)sink;
+    return timer.Microsecond("stop", "start") * 1000.0 / ((double)node_count * rounds);
+  };
+
+  std::cout << std::fixed << std::setprecision(2)
+            << "sort entries " << std::setw(2) << n << "  "
+            << time([](const uint64_t* keys, int n, int* index) {
+                 combotree::ScalarSortSlots(keys, n, index);
+               })
+            << " -> "
+            << time([](const uint64_t* keys, int n, int* index) {
+                 combotree::SortSlots(keys, n, index);
+               })
+            << std::endl;
+}
+#endif // BUF_SORT
+
+int main() {
+#ifdef BUF_SORT
+  std::cout << "BUF_SORT = 1, KVBuffer uses binary search" << std::endl;
+#else
+#if defined(KVBUFFER_SIMD) && defined(__AVX512BW__)
+  std::cout << "KVBUFFER_SIMD: AVX-512" << std::endl;
+#elif defined(KVBUFFER_SIMD)
+  std::cout << "KVBUFFER_SIMD: AVX2" << std::endl;
+#else
+  std::cout << "KVBUFFER_SIMD: off" << std::endl;
+#endif
+#ifdef BUF_FINGERPRINT
+  std::cout << "ns per node, scalar -> Find() / Find() with fingerprints" << std::endl;
+#else
+  std::cout << "ns per node, scalar -> Find()" << std::endl;
+#endif
+  // nodes in cache, then nodes in memory
+  for (int node_count : {CACHED_NODES, MEMORY_NODES}) {
+    int rounds = node_count == CACHED_NODES ? 10 : 1;
+    std::cout << node_count << " nodes" << std::endl;
+    for (int suffix_bytes = 1; suffix_bytes <= 8; ++suffix_bytes)
+      Bench<8>(suffix_bytes, node_count, rounds);
+    for (int suffix_bytes = 1; suffix_bytes <= 8; ++suffix_bytes)
+      Bench<6>(suffix_bytes, node_count, rounds);
+  }
+  std::cout << "ns per node, std::sort -> SortSlots()" << std::endl;
+  for (int n = 2; n <= 16; ++n)
+    BenchSort(n, CACHED_NODES, 1000);
+#endif // BUF_SORT
+  return 0;
+}
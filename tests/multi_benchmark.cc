@@ -14,6 +14,8 @@ size_t TEST_SIZE      = 10000000;
 size_t LAST_EXPAND    = 6000000;
 size_t GET_SIZE       = 1000000;
 size_t SCAN_TEST_SIZE = 500000000;
+size_t HOT_KEYS       = 1000;
+int UPDATE_RATIO      = 10;
 
 int thread_num        = 4;
 bool use_data_file    = false;
@@ -58,6 +60,8 @@ void show_help(char* prog) {
     "    --last-expand            LAST_EXPAND" << std::endl <<
     "    --get-size               GET_SIZE" << std::endl <<
     "    --scan-test-size         SCAN_TEST_SIZE" << std::endl <<
+    "    --hot-keys               keys read and updated by mixed test, 0 to skip" << std::endl <<
+    "    --update-ratio           percentage of updates in mixed test" << std::endl <<
     "    --scan[-s]               add scan" << std::endl <<
     "    --sort-scan              add sort scan" << std::endl <<
     "    --use-data-file[-d]      use data file" << std::endl <<
@@ -76,6 +80,8 @@ int main(int argc, char** argv) {
     {"sort-scan",       required_argument, NULL, 0},
     {"use-data-file",   no_argument,       NULL, 'd'},
     {"help",            no_argument,       NULL, 'h'},
+    {"hot-keys",        required_argument, NULL, 0},
+    {"update-ratio",    required_argument, NULL, 0},
     {NULL, 0, NULL, 0}
   };
 
@@ -94,6 +100,8 @@ int main(int argc, char** argv) {
           case 6: sort_scan_size.push_back(atoi(optarg)); break;
           case 7: use_data_file = true; break;
           case 8: show_help(argv[0]); return 0;
+          case 9: HOT_KEYS = atoi(optarg); break;
+          case 10: UPDATE_RATIO = atoi(optarg); break;
           default: std::cerr << "Parse Argument Error!" << std::endl; abort();
         }
         break;
@@ -120,6 +128,8 @@ int main(int argc, char** argv) {
   std::cout << "LAST_EXPAND:           " << LAST_EXPAND << std::endl;
   std::cout << "GET_SIZE:              " << GET_SIZE << std::endl;
   std::cout << "SCAN_TEST_SIZE:        " << SCAN_TEST_SIZE << std::endl;
+  std::cout << "HOT_KEYS:              " << HOT_KEYS << std::endl;
+  std::cout << "UPDATE_RATIO:          " << UPDATE_RATIO << "%" << std::endl;
   for (auto &sz : scan_size)
     std::cout << "SCAN:                  " << sz << std::endl;
   for (auto &sz : sort_scan_size)
@@ -129,6 +139,7 @@ int main(int argc, char** argv) {
   std::cout << "EXPANSION_FACTOR:      " << EXPANSION_FACTOR << std::endl;
   std::cout << "PMEMKV_THRESHOLD:      " << PMEMKV_THRESHOLD << std::endl;
   std::cout << "ENTRY_SIZE_FACTOR:     " << ENTRY_SIZE_FACTOR << std::endl;
+  std::cout << "SCAN_PREFETCH_DISTANCE: " << SCAN_PREFETCH_DISTANCE << std::endl;
 
 #ifdef BUF_SORT
   std::cout << "BUF_SORT = 1" << std::endl;
@@ -142,6 +153,14 @@ int main(int argc, char** argv) {
   std::cout << "STREAMING_LOAD  = 1" << std::endl;
 #endif
 
+#if defined(OPTIMISTIC_LOCK)
+  std::cout << "ENTRY LOCK:            optimistic version lock" << std::endl;
+#elif defined(NO_LOCK)
+  std::cout << "ENTRY LOCK:            none" << std::endl;
+#else
+  std::cout << "ENTRY LOCK:            reader-writer spin lock" << std::endl;
+#endif
+
   std::vector<uint64_t> key;
 
   if (use_data_file) {
@@ -216,6 +235,9 @@ int main(int argc, char** argv) {
   std::cout << "size:           " << tree->Size() << std::endl;
   std::cout << "usage:          " << human_readable(tree->Usage()) << std::endl;
   std::cout << "bytes-per-pair: " << (double)tree->Usage() / tree->Size() << std::endl;
+  std::cout << "lock usage:     " << human_readable(tree->LockUsage()) << std::endl;
+  std::cout << "filter usage:   " << human_readable(tree->FilterUsage()) << std::endl;
+  std::cout << "reclaimable:    " << human_readable(tree->ReclaimableUsage()) << std::endl;
   tree->BLevelCompression();
 
   // Get
@@ -245,6 +267,37 @@ int main(int argc, char** argv) {
     assert(tree->Get(i, value) == false);
   }
 
+  // mixed get/update on hot keys, all threads share the same entries
+  if (HOT_KEYS != 0) {
+    size_t hot_keys = std::min(HOT_KEYS, TEST_SIZE);
+    per_thread_size = GET_SIZE / thread_num;
+    timer.Clear();
+    timer.Record("start");
+    for (int i = 0; i < thread_num; ++i) {
+      threads.emplace_back([=,&key](){
+        size_t size = (i == thread_num-1) ? GET_SIZE-(thread_num-1)*per_thread_size : per_thread_size;
+        Random rnd(0, hot_keys-1);
+        Random op(0, 99);
+        size_t value;
+        for (size_t j = 0; j < size; ++j) {
+          uint64_t k = key[rnd.Next()];
+          if ((int)op.Next() < UPDATE_RATIO) {
+            tree->Put(k, k);
+          } else {
+            assert(tree->Get(k, value) == true);
+            assert(value == k);
+          }
+        }
+      });
+    }
+    for (auto& t : threads)
+      t.join();
+    threads.clear();
+    timer.Record("stop");
+    total_time = timer.Microsecond("stop", "start");
+    std::cout << "mixed: " << total_time/1000000.0 << " " << (double)GET_SIZE/(double)total_time*1000000.0 << std::endl;
+  }
+
   // scan
   for (auto scan : scan_size) {
     size_t total_size = std::min(SCAN_TEST_SIZE / scan, TEST_SIZE);
@@ -308,6 +361,34 @@ int main(int argc, char** argv) {
     std::cout << "sort scan " << scan << ": " << total_time/1000000.0 << " " << (double)total_size/(double)total_time*1000000.0 << std::endl;
   }
 
+  // whole key range by one Iter and by ParallelScan(), pairs per second
+  {
+    size_t iter_cnt = 0;
+    timer.Clear();
+    timer.Record("start");
+    for (ComboTree::Iter iter(tree); !iter.end(); iter.next()) {
+      assert(iter.key() == iter.value());
+      iter_cnt++;
+    }
+    timer.Record("stop");
+    total_time = timer.Microsecond("stop", "start");
+    std::cout << "full scan iter: " << total_time/1000000.0 << " " << (double)iter_cnt/(double)total_time*1000000.0 << std::endl;
+
+    int chunks = thread_num * 8;
+    std::vector<size_t> chunk_cnt(chunks * 8, 0);  // padded to a cache line per chunk
+    timer.Clear();
+    timer.Record("start");
+    size_t cnt = tree->ParallelScan(0, UINT64_MAX, chunks, thread_num,
+        [&](int chunk, uint64_t key, uint64_t value) {
+          assert(key == value);
+          chunk_cnt[chunk * 8]++;
+        });
+    timer.Record("stop");
+    total_time = timer.Microsecond("stop", "start");
+    assert(cnt == iter_cnt);
+    std::cout << "full scan parallel: " << total_time/1000000.0 << " " << (double)cnt/(double)total_time*1000000.0 << std::endl;
+  }
+
   // Delete
   // for (auto& k : key) {
   //   assert(tree->Delete(k) == true);
@@ -2,6 +2,7 @@
 #include <cassert>
 #include <iomanip>
 #include <thread>
+#include <atomic>
 #include <map>
 #include "combotree/combotree.h"
 #include "combotree_config.h"
@@ -86,5 +87,54 @@ int main(void) {
     assert(tree->Get(i, value) == false);
   }
 
+  // PUT and GET while the tree expands online, expansion replaces the
+  // levels that requests are working on. puts grow a new tree 8 times.
+  {
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+#else
+    tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+#endif
+    const uint64_t base_size = TEST_SIZE / 8;
+    for (uint64_t k = 0; k < base_size; ++k)
+      assert(tree->Put(k, k) == true);
+    while (tree->IsExpanding()) ;
+    size_t entries = tree->BLevelEntries();
+
+    std::atomic<bool> put_done(false);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < thread_num; ++i) {
+      threads.emplace_back([=](){
+        for (uint64_t k = base_size + i; k < TEST_SIZE; k += thread_num)
+          assert(tree->Put(k, k) == true);
+      });
+      readers.emplace_back([=,&put_done](){
+        Random rnd(0, base_size-1);
+        uint64_t value;
+        while (!put_done.load()) {
+          uint64_t k = rnd.Next();
+          assert(tree->Get(k, value) == true);
+          assert(value == k);
+        }
+      });
+    }
+    for (auto& t : threads)
+      t.join();
+    threads.clear();
+    put_done.store(true);
+    for (auto& t : readers)
+      t.join();
+    while (tree->IsExpanding()) ;
+    assert(tree->BLevelEntries() > entries);
+    assert(tree->Size() == TEST_SIZE);
+    for (uint64_t k = 0; k < TEST_SIZE; ++k) {
+      uint64_t value;
+      assert(tree->Get(k, value) == true);
+      assert(value == k);
+    }
+  }
+
+  delete tree;
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <cassert>
+#include "combotree/combotree.h"
+#include "combotree_config.h"
+#include "timer.h"
+
+#define TEST_SIZE   400000000
+#define CHECK_SIZE  1000000
+
+using combotree::ComboTree;
+using combotree::Timer;
+
+namespace {
+
+// murmur3 finalizer, a bijection so keys of different i never collide
+uint64_t Key(uint64_t i) {
+  uint64_t key = i + 1;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdUL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53UL;
+  key ^= key >> 33;
+  return key;
+}
+
+ComboTree* OpenTree(bool create) {
+#ifdef SERVER
+  return new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), create);
+#else
+  return new ComboTree("/mnt/pmem0/", (1024*1024*512UL), create);
+#endif
+}
+
+} // anonymous namespace
+
+// load test_size keys, close the tree and open it again
+int main(int argc, char** argv) {
+  uint64_t test_size = argc == 2 ? atol(argv[1]) : TEST_SIZE;
+
+  std::cout << "TEST_SIZE:             " << test_size << std::endl;
+  std::cout << "RECOVERY_THREADS:      " << RECOVERY_THREADS << std::endl;
+
+  Timer timer;
+  ComboTree* tree = OpenTree(true);
+  timer.Record("load_start");
+  for (uint64_t i = 0; i < test_size; ++i)
+    tree->Put(Key(i), i);
+  while (tree->IsExpanding()) ;
+  timer.Record("load_stop");
+  uint64_t size = tree->Size();
+  uint64_t entries = tree->BLevelEntries();
+  delete tree;
+
+  timer.Record("restart_start");
+  tree = OpenTree(false);
+  timer.Record("restart_stop");
+
+  std::cout << "load:                  "
+            << timer.Milliseconds("load_stop", "load_start") / 1000.0 << "s" << std::endl;
+  std::cout << "restart:               "
+            << timer.Milliseconds("restart_stop", "restart_start") / 1000.0 << "s" << std::endl;
+  std::cout << "blevel entries:        " << tree->BLevelEntries() << std::endl;
+
+  if (tree->Size() != size || tree->BLevelEntries() != entries) {
+    std::cout << "size " << tree->Size() << " entries " << tree->BLevelEntries()
+              << " after restart, expect " << size << " " << entries << std::endl;
+    return 1;
+  }
+  uint64_t step = std::max(1UL, test_size / CHECK_SIZE);
+  for (uint64_t i = 0; i < test_size; i += step) {
+    uint64_t value;
+    if (!tree->Get(Key(i), value) || value != i) {
+      std::cout << "key " << Key(i) << " is lost after restart" << std::endl;
+      return 1;
+    }
+  }
+  std::cout << "check:                 ok" << std::endl;
+
+  delete tree;
+  return 0;
+}